@@ -0,0 +1,467 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "usb_io.h"
+
+#define ARCHIVE_HASH_MUL 0x9e3779b97f4a7c15ULL
+#define COMPARE_CHUNK 0x10000
+
+static char *make_dir(const char *root, const char *name)
+{
+    char *path = malloc(strlen(root) + strlen(name) + 2);
+
+    if(path == NULL)
+    {
+        return NULL;
+    }
+    sprintf(path, "%s/%s", root, name);
+    if((0 != mkdir(path, 0777)) && (errno != EEXIST))
+    {
+        fprintf(stderr, "ERROR: Can not create %s: %s\n", path,
+                strerror(errno));
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+int archive_open(struct archive *a, const char *root)
+{
+    memset(a, 0, sizeof(*a));
+    if((0 != mkdir(root, 0777)) && (errno != EEXIST))
+    {
+        fprintf(stderr, "ERROR: Can not create %s: %s\n", root,
+                strerror(errno));
+        return -errno;
+    }
+
+    a->objects = make_dir(root, "objects");
+    a->probes = make_dir(root, "probes");
+    if((a->objects == NULL) || (a->probes == NULL))
+    {
+        archive_close(a);
+        return -EIO;
+    }
+    return 0;
+}
+
+void archive_close(struct archive *a)
+{
+    free(a->objects);
+    free(a->probes);
+    memset(a, 0, sizeof(*a));
+}
+
+/* A multiply and shift hash over 64 bit words in host byte order. It keeps
+ * well ahead of any USB transfer, and archive_add() confirms every object it
+ * matches by comparing the data before anything is linked. */
+static __u64 hash_word(__u64 h, __u64 w)
+{
+    h ^= w;
+    h *= ARCHIVE_HASH_MUL;
+    return h ^ (h >> 29);
+}
+
+void archive_hash_init(struct archive_hash *ah)
+{
+    memset(ah, 0, sizeof(*ah));
+    ah->h = 0xcbf29ce484222325ULL;
+}
+
+void archive_hash_update(struct archive_hash *ah, const void *buf, size_t len)
+{
+    const __u8 *p = buf;
+    __u64 w;
+
+    ah->length += len;
+    if(ah->tailLen > 0)
+    {
+        size_t n = 8 - ah->tailLen;
+
+        if(n > len)
+        {
+            n = len;
+        }
+        memcpy(&ah->tail[ah->tailLen], p, n);
+        ah->tailLen += n;
+        p += n;
+        len -= n;
+        if(ah->tailLen < 8)
+        {
+            return;
+        }
+        memcpy(&w, ah->tail, 8);
+        ah->h = hash_word(ah->h, w);
+        ah->tailLen = 0;
+    }
+
+    while(len >= 8)
+    {
+        memcpy(&w, p, 8);
+        ah->h = hash_word(ah->h, w);
+        p += 8;
+        len -= 8;
+    }
+
+    memcpy(ah->tail, p, len);
+    ah->tailLen = len;
+}
+
+__u64 archive_hash_final(const struct archive_hash *ah)
+{
+    __u64 h = ah->h;
+    __u64 w = 0;
+
+    if(ah->tailLen > 0)
+    {
+        memcpy(&w, ah->tail, ah->tailLen);
+        h = hash_word(h, w);
+    }
+
+    h ^= ah->length;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+int archive_hash_file(const char *path, __u64 *hash, __u64 *size)
+{
+    struct archive_hash ah;
+    __u8 *buf;
+    ssize_t r;
+    int fd;
+
+    fd = open64(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return -errno;
+    }
+    buf = malloc(COMPARE_CHUNK);
+    if(buf == NULL)
+    {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    archive_hash_init(&ah);
+    while(0 < (r = read(fd, buf, COMPARE_CHUNK)))
+    {
+        archive_hash_update(&ah, buf, r);
+    }
+    if(r < 0)
+    {
+        r = -errno;
+    }
+    free(buf);
+    close(fd);
+
+    *hash = archive_hash_final(&ah);
+    *size = ah.length;
+    return r;
+}
+
+/* Pick the sample offsets for a file of the given size. Returns 0 if the
+ * file is too small to be worth probing. */
+int archive_sample_offsets(struct archive_probe *probe, __u64 size)
+{
+    probe->size = size;
+    if(size < 4 * ARCHIVE_SAMPLE)
+    {
+        return 0;
+    }
+    probe->offset[0] = 0;
+    probe->offset[1] = (size / 2) & ~((__u64) ARCHIVE_SAMPLE - 1);
+    probe->offset[2] = size - ARCHIVE_SAMPLE;
+    return 1;
+}
+
+static char *probe_path(const struct archive *a,
+                        const struct archive_probe *probe)
+{
+    struct archive_hash ah;
+    char *path = malloc(strlen(a->probes) + 18);
+
+    if(path == NULL)
+    {
+        return NULL;
+    }
+    archive_hash_init(&ah);
+    archive_hash_update(&ah, &probe->size, sizeof(probe->size));
+    archive_hash_update(&ah, probe->sample, sizeof(probe->sample));
+    sprintf(path, "%s/%016llx", a->probes, archive_hash_final(&ah));
+    return path;
+}
+
+static char *object_path(const struct archive *a, __u64 hash, __u64 size)
+{
+    char *path = malloc(strlen(a->objects) + 36);
+
+    if(path != NULL)
+    {
+        sprintf(path, "%s/%016llx-%llx", a->objects, hash, size);
+    }
+    return path;
+}
+
+static int same_file(const char *a, const char *b)
+{
+    struct stat64 sa;
+    struct stat64 sb;
+
+    return (0 == stat64(a, &sa)) && (0 == stat64(b, &sb)) &&
+        (sa.st_dev == sb.st_dev) && (sa.st_ino == sb.st_ino);
+}
+
+/* Replace dstPath with a hard link to srcPath. The link is made under a
+ * temporary name and renamed into place, so dstPath never goes missing. */
+static int link_replace(const char *srcPath, const char *dstPath)
+{
+    char *tmpPath;
+    int r = 0;
+
+    if(same_file(srcPath, dstPath))
+    {
+        return 0;
+    }
+
+    tmpPath = malloc(strlen(dstPath) + 6);
+    if(tmpPath == NULL)
+    {
+        return -ENOMEM;
+    }
+    sprintf(tmpPath, "%s.link", dstPath);
+    unlink(tmpPath);
+
+    if(0 != link(srcPath, tmpPath))
+    {
+        r = -errno;
+    }
+    else if(0 != rename(tmpPath, dstPath))
+    {
+        r = -errno;
+        unlink(tmpPath);
+    }
+
+    if(r != 0)
+    {
+        fprintf(stderr, "ERROR: Can not link %s to %s: %s\n", dstPath,
+                srcPath, strerror(-r));
+    }
+    free(tmpPath);
+    return r;
+}
+
+static int read_at(int fd, __u8 *buf, size_t len, __u64 offset)
+{
+    while(len > 0)
+    {
+        ssize_t r = pread64(fd, buf, len, offset);
+
+        if(r <= 0)
+        {
+            return (r < 0) ? -errno : -EIO;
+        }
+        buf += r;
+        len -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+/* Returns 1 if both files hold the same bytes. */
+static int compare_files(const char *a, const char *b, __u64 size)
+{
+    __u8 *bufA;
+    __u8 *bufB;
+    __u64 offset;
+    int fdA;
+    int fdB;
+    int r = 1;
+
+    fdA = open64(a, O_RDONLY);
+    fdB = open64(b, O_RDONLY);
+    bufA = malloc(COMPARE_CHUNK);
+    bufB = malloc(COMPARE_CHUNK);
+    if((fdA < 0) || (fdB < 0) || (bufA == NULL) || (bufB == NULL))
+    {
+        r = 0;
+    }
+
+    for(offset = 0; (r == 1) && (offset < size); offset += COMPARE_CHUNK)
+    {
+        size_t n = COMPARE_CHUNK;
+
+        if(n > size - offset)
+        {
+            n = size - offset;
+        }
+        r = (0 == read_at(fdA, bufA, n, offset)) &&
+            (0 == read_at(fdB, bufB, n, offset)) &&
+            (0 == memcmp(bufA, bufB, n));
+    }
+
+    free(bufA);
+    free(bufB);
+    if(fdA >= 0)
+    {
+        close(fdA);
+    }
+    if(fdB >= 0)
+    {
+        close(fdB);
+    }
+    return r;
+}
+
+/* Look for an object whose size and samples match the probe. If one is
+ * found, dstPath is made a link to it and 1 is returned. The rest of the
+ * remote file is never read, so the match is trusted as it is. */
+int archive_find(const struct archive *a, const struct archive_probe *probe,
+                 const char *dstPath)
+{
+    struct stat64 st;
+    char *path;
+    __u8 *buf;
+    int match;
+    int fd;
+    int i;
+    int r;
+
+    path = probe_path(a, probe);
+    buf = malloc(ARCHIVE_SAMPLE);
+    if((path == NULL) || (buf == NULL))
+    {
+        free(path);
+        free(buf);
+        return -ENOMEM;
+    }
+
+    fd = open64(path, O_RDONLY);
+    match = (fd >= 0) && (0 == fstat64(fd, &st)) &&
+        ((__u64) st.st_size == probe->size);
+    for(i = 0; match && (i < ARCHIVE_SAMPLES); i++)
+    {
+        match = (0 == read_at(fd, buf, ARCHIVE_SAMPLE, probe->offset[i])) &&
+            (0 == memcmp(buf, probe->sample[i], ARCHIVE_SAMPLE));
+    }
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+
+    r = 0;
+    if(match)
+    {
+        trace(1, fprintf(stderr, "%s matches archived %s\n", dstPath, path));
+        r = link_replace(path, dstPath);
+        if(r == 0)
+        {
+            r = 1;
+        }
+    }
+
+    free(path);
+    free(buf);
+    return r;
+}
+
+/* Enter a freshly fetched file into the store. If an object with the same
+ * contents exists, path becomes a link to it; otherwise path becomes the
+ * object. probe may be NULL if the file was not sampled. */
+int archive_add(const struct archive *a, const char *path, __u64 hash,
+                __u64 size, const struct archive_probe *probe)
+{
+    struct stat64 st;
+    char *object;
+    char *key;
+    int exists;
+    int r = 0;
+
+    object = object_path(a, hash, size);
+    if(object == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    /* Another thread may enter the same contents at the same time, in
+       which case the link fails and the object is compared instead. */
+    exists = (0 == stat64(object, &st));
+    if(!exists && (0 != link(path, object)))
+    {
+        if(errno == EEXIST)
+        {
+            exists = 1;
+        }
+        else
+        {
+            r = -errno;
+            fprintf(stderr, "ERROR: Can not link %s to %s: %s\n", object,
+                    path, strerror(errno));
+        }
+    }
+
+    if(exists)
+    {
+        if(compare_files(object, path, size))
+        {
+            trace(1, fprintf(stderr, "%s duplicates %s\n", path, object));
+            r = link_replace(object, path);
+        }
+        else
+        {
+            /* A hash collision. Keep the file, but leave it out. */
+            fprintf(stderr, "WARNING: %s differs from %s, not archived\n",
+                    path, object);
+            free(object);
+            return 0;
+        }
+    }
+
+    if((r == 0) && (probe != NULL) && (probe->size == size))
+    {
+        key = probe_path(a, probe);
+        if((key != NULL) && (0 != link(object, key)) && (errno != EEXIST))
+        {
+            fprintf(stderr, "WARNING: Can not link %s to %s: %s\n", key,
+                    object, strerror(errno));
+        }
+        free(key);
+    }
+
+    free(object);
+    return r;
+}
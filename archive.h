@@ -0,0 +1,91 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _ARCHIVE_H
+#define _ARCHIVE_H 1
+
+#include <stddef.h>
+#include <asm/types.h>
+
+/* A content addressed archive store.
+ *
+ * Every file fetched into the store is also linked as
+ *   <store>/objects/<hash>-<size>
+ * where hash is a 64 bit hash of the whole file, computed as the data
+ * streams in. A file whose contents are already in the store is replaced
+ * with a hard link to the existing object, after a byte by byte comparison.
+ *
+ * To avoid fetching a duplicate at all, each object is also linked as
+ *   <store>/probes/<key>
+ * where key is a hash of the size and of a few samples taken from the start,
+ * middle and end of the file. Those samples can be read from the device
+ * with a few packets, so a renamed or moved recording is found before it is
+ * transferred again. Unlike a hash match, a probe match is not confirmed
+ * against the whole file: two files of the same size that agree in every
+ * sample are taken to be the same.
+ */
+
+/* Bytes in each probe sample */
+#define ARCHIVE_SAMPLE 0x4000
+#define ARCHIVE_SAMPLES 3
+
+struct archive
+{
+    char *objects;
+    char *probes;
+};
+
+struct archive_hash
+{
+    __u64 h;
+    __u64 length;
+    __u8 tail[8];
+    int tailLen;
+};
+
+/* Samples of a remote file, taken at the offsets given by
+   archive_sample_offsets() */
+struct archive_probe
+{
+    __u64 size;
+    __u64 offset[ARCHIVE_SAMPLES];
+    __u8 sample[ARCHIVE_SAMPLES][ARCHIVE_SAMPLE];
+};
+
+int archive_open(struct archive *a, const char *root);
+void archive_close(struct archive *a);
+
+void archive_hash_init(struct archive_hash *ah);
+void archive_hash_update(struct archive_hash *ah, const void *buf,
+                         size_t len);
+__u64 archive_hash_final(const struct archive_hash *ah);
+int archive_hash_file(const char *path, __u64 *hash, __u64 *size);
+
+int archive_sample_offsets(struct archive_probe *probe, __u64 size);
+int archive_find(const struct archive *a, const struct archive_probe *probe,
+                 const char *dstPath);
+int archive_add(const struct archive *a, const char *path, __u64 hash,
+                __u64 size, const struct archive_probe *probe);
+
+#endif /* _ARCHIVE_H */
@@ -0,0 +1,171 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "usb_io.h"
+
+/*
+ * A batch file holds one command per line, written as it would be after -c
+ * on the command line, for example:
+ *
+ *   mkdir \DataFiles\Archive
+ *   get "\DataFiles\News at Ten.rec" news.rec
+ *
+ * Words are separated by white space. Single or double quotes group words
+ * that contain spaces. There are no escapes, because the backslash is the
+ * Toppy's path separator. Blank lines and lines starting with # are skipped.
+ */
+
+/* Split line into words in place. Returns the number of words, or -1 if a
+ * quote is not closed or there are more than max words. */
+int batch_split(char *line, char *argv[], int max)
+{
+    char *in = line;
+    int argc = 0;
+
+    for(;;)
+    {
+        char *out;
+
+        while((*in == ' ') || (*in == '\t') || (*in == '\r') || (*in == '\n'))
+        {
+            in++;
+        }
+        if((*in == '\0') || ((argc == 0) && (*in == '#')))
+        {
+            break;
+        }
+        if(argc == max)
+        {
+            return -1;
+        }
+
+        /* Words are only ever shortened, so they can be unquoted in place */
+        argv[argc++] = out = in;
+        while((*in != '\0') && (*in != ' ') && (*in != '\t') &&
+              (*in != '\r') && (*in != '\n'))
+        {
+            if((*in == '"') || (*in == '\''))
+            {
+                char quote = *in++;
+
+                while((*in != '\0') && (*in != quote))
+                {
+                    *out++ = *in++;
+                }
+                if(*in != quote)
+                {
+                    return -1;
+                }
+                in++;
+            }
+            else
+            {
+                *out++ = *in++;
+            }
+        }
+
+        if(*in != '\0')
+        {
+            in++;
+        }
+        *out = '\0';
+    }
+
+    return argc;
+}
+
+/* Run every command in a batch file, reporting the result of each line on
+ * stdout as "name:line: OK" or "name:line: FAILED (result)". Unless
+ * keepGoing is set, the batch stops at the first failure. Returns 0 if every
+ * command succeeded, otherwise the result of the first that failed. */
+int batch_run(FILE *in, const char *name, int keepGoing, int fd,
+              batch_handler handler)
+{
+    char *line = NULL;
+    size_t lineSize = 0;
+    char *argv[BATCH_MAX_ARGS + 1];
+    int lineNo = 0;
+    int done = 0;
+    int failed = 0;
+    int result = 0;
+
+    while(0 < getline(&line, &lineSize, in))
+    {
+        int argc;
+        int r;
+
+        lineNo++;
+        argc = batch_split(line, argv, BATCH_MAX_ARGS);
+        if(argc == 0)
+        {
+            continue;
+        }
+
+        if(argc < 0)
+        {
+            fprintf(stderr,
+                    "ERROR: %s:%d: Unmatched quote or too many words\n",
+                    name, lineNo);
+            r = -EINVAL;
+        }
+        else
+        {
+            argv[argc] = NULL;
+            r = handler(fd, argc, argv);
+        }
+
+        done++;
+        fflush(stderr);
+        if(r == 0)
+        {
+            printf("%s:%d: OK\n", name, lineNo);
+        }
+        else
+        {
+            printf("%s:%d: FAILED (%d)\n", name, lineNo, r);
+            if(failed++ == 0)
+            {
+                result = r;
+            }
+        }
+        fflush(stdout);
+
+        if((r != 0) && !keepGoing)
+        {
+            break;
+        }
+    }
+
+    trace(1, fprintf(stderr, "%s: %d commands run, %d failed\n", name, done,
+                     failed));
+    free(line);
+    return result;
+}
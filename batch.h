@@ -0,0 +1,40 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _BATCH_H
+#define _BATCH_H 1
+
+#include <stdio.h>
+
+/* Most words, including the command itself, on one line of a batch file */
+#define BATCH_MAX_ARGS 16
+
+/* Runs one line of a batch, split into words. Returns the command's result. */
+typedef int (*batch_handler) (int fd, int argc, char *argv[]);
+
+int batch_split(char *line, char *argv[], int max);
+int batch_run(FILE *in, const char *name, int keepGoing, int fd,
+              batch_handler handler);
+
+#endif /* _BATCH_H */
@@ -0,0 +1,193 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include <string.h>
+#include "byte_swap.h"
+
+/* Every packet is byte swapped on the way in and on the way out, so this
+ * runs over every byte of every transfer. The vector versions are chosen
+ * once by byte_swap_init(); until then the scalar reference is used.
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__) && (__GNUC__ >= 5)
+#define HAVE_X86_SWAP 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_SWAP 1
+#include <arm_neon.h>
+#endif
+
+typedef void (*swap_fn) (__u8 * d, int count);
+
+static swap_fn swap_impl = byte_swap_scalar;
+
+/* Swap the odd and even bytes in the buffer, up to count bytes.
+ * If count is odd, the last byte remains unafected.
+ */
+void byte_swap_scalar(__u8 * d, int count)
+{
+    int i;
+
+    for(i = 0; i < (count & ~1); i += 2)
+    {
+        __u8 t = d[i];
+
+        d[i] = d[i + 1];
+        d[i + 1] = t;
+    }
+}
+
+#ifndef HAVE_NEON_SWAP
+
+/* Portable version that swaps a machine word at a time. The mask and shift
+ * give the same result on big and little endian hosts, which covers the
+ * ARMv5 and MIPS cross targets.
+ */
+static void byte_swap_word(__u8 * d, int count)
+{
+    const unsigned long mask = ~0UL / 0xffff * 0xff;
+    int n = count & ~1;
+    int i = 0;
+
+    /* Word access only lines up with the byte pairs from an even start. */
+    if(((unsigned long) d & 1) != 0)
+    {
+        byte_swap_scalar(d, count);
+        return;
+    }
+
+    while((i < n) && (((unsigned long) (d + i) & (sizeof(long) - 1)) != 0))
+    {
+        __u8 t = d[i];
+
+        d[i] = d[i + 1];
+        d[i + 1] = t;
+        i += 2;
+    }
+
+    for(; i + (int) sizeof(long) <= n; i += sizeof(long))
+    {
+        unsigned long w;
+
+        memcpy(&w, d + i, sizeof(w));
+        w = ((w & mask) << 8) | ((w >> 8) & mask);
+        memcpy(d + i, &w, sizeof(w));
+    }
+
+    byte_swap_scalar(d + i, n - i);
+}
+
+#endif /* HAVE_NEON_SWAP */
+
+#ifdef HAVE_X86_SWAP
+
+__attribute__ ((target("ssse3")))
+static void byte_swap_ssse3(__u8 * d, int count)
+{
+    const __m128i shuf =
+        _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    int n = count & ~1;
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (d + i));
+
+        _mm_storeu_si128((__m128i *) (d + i), _mm_shuffle_epi8(v, shuf));
+    }
+
+    byte_swap_scalar(d + i, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static void byte_swap_avx2(__u8 * d, int count)
+{
+    const __m256i shuf =
+        _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                         1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    int n = count & ~1;
+    int i;
+
+    for(i = 0; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (d + i));
+
+        _mm256_storeu_si256((__m256i *) (d + i), _mm256_shuffle_epi8(v, shuf));
+    }
+
+    byte_swap_scalar(d + i, n - i);
+}
+
+#endif /* HAVE_X86_SWAP */
+
+#ifdef HAVE_NEON_SWAP
+
+static void byte_swap_neon(__u8 * d, int count)
+{
+    int n = count & ~1;
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16)
+    {
+        vst1q_u8(d + i, vrev16q_u8(vld1q_u8(d + i)));
+    }
+
+    byte_swap_scalar(d + i, n - i);
+}
+
+#endif /* HAVE_NEON_SWAP */
+
+const char *byte_swap_init(void)
+{
+#ifdef HAVE_X86_SWAP
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+    {
+        swap_impl = byte_swap_avx2;
+        return "avx2";
+    }
+
+    if(__builtin_cpu_supports("ssse3"))
+    {
+        swap_impl = byte_swap_ssse3;
+        return "ssse3";
+    }
+#endif
+
+#ifdef HAVE_NEON_SWAP
+    swap_impl = byte_swap_neon;
+    return "neon";
+#else
+    swap_impl = byte_swap_word;
+    return "word";
+#endif
+}
+
+void byte_swap(__u8 * d, int count)
+{
+    swap_impl(d, count);
+}
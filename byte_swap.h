@@ -0,0 +1,41 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _BYTE_SWAP_H
+#define _BYTE_SWAP_H 1
+
+#include <asm/types.h>
+
+/* Select the fastest byte swap routine for this CPU.
+ * Returns the name of the chosen implementation.
+ */
+const char *byte_swap_init(void);
+
+/* Swap the odd and even bytes in the buffer, up to count bytes. */
+void byte_swap(__u8 * d, int count);
+
+/* Reference implementation, one byte pair at a time. */
+void byte_swap_scalar(__u8 * d, int count);
+
+#endif /* _BYTE_SWAP_H */
@@ -26,4 +26,12 @@
 #include <sys/types.h>
 #include <asm/types.h>
 
+/* Pick the fastest CRC engine that matches the reference table.
+ * Returns the name of the chosen engine.
+ */
+const char *crc16_init(void);
+
 __u16 crc16_ansi(const void *data, size_t size);
+
+/* Continue a CRC over more data. */
+__u16 crc16_ansi_update(__u16 crc, const void *data, size_t size);
@@ -0,0 +1,807 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/un.h>
+#include "usb_io.h"
+#include "byte_swap.h"
+#include "crc16.h"
+#include "mjd.h"
+#include "tf_bytes.h"
+#include "transport.h"
+
+/* puppy-emu pretends to be a Toppy, with a local directory standing in for
+ * its hard disk. It serves one client at a time on a SOCK_SEQPACKET Unix
+ * socket, which puppy and libpuppy reach through the socket transport with
+ * a device path of unix:<socket>. Packets are built, checksummed and byte
+ * swapped by the same code that puppy uses, so the whole protocol stack can
+ * be exercised and timed without a device.
+ */
+
+#define PUT 0
+#define GET 1
+
+/* Error codes carried by FAIL, as understood by decode_error() */
+#define EMU_UNKNOWN_COMMAND 2
+#define EMU_INVALID_COMMAND 3
+#define EMU_RUN_ERROR 6
+#define EMU_MEMORY_FULL 7
+
+/* How long after a cancelled transfer to keep discarding the SUCCESS and
+   CANCEL packets that the host may still have had on the way. */
+#define DRAIN_MS 1000
+
+static char *root = NULL;
+static struct tf_packet in;
+static struct tf_packet out;
+static struct timespec drainUntil;
+static volatile sig_atomic_t stopping = 0;
+
+static void emu_stop(int sig)
+{
+    (void) sig;
+    stopping = 1;
+}
+
+static void start_drain(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &drainUntil);
+    drainUntil.tv_sec += DRAIN_MS / 1000;
+    drainUntil.tv_nsec += (DRAIN_MS % 1000) * 1000000;
+    if(drainUntil.tv_nsec >= 1000000000)
+    {
+        drainUntil.tv_sec++;
+        drainUntil.tv_nsec -= 1000000000;
+    }
+}
+
+static int draining(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec < drainUntil.tv_sec) ||
+        ((now.tv_sec == drainUntil.tv_sec) &&
+         (now.tv_nsec < drainUntil.tv_nsec));
+}
+
+static ssize_t send_simple(int fd, __u32 cmd)
+{
+    put_u16(&out.length, PACKET_HEAD_SIZE);
+    put_u32(&out.cmd, cmd);
+    return send_tf_packet(fd, &out);
+}
+
+static ssize_t send_fail(int fd, __u32 ecode)
+{
+    put_u16(&out.length, PACKET_HEAD_SIZE + 4);
+    put_u32(&out.cmd, FAIL);
+    put_u32(out.data, ecode);
+    return send_tf_packet(fd, &out);
+}
+
+static __u32 errno_to_ecode(int e)
+{
+    switch (e)
+    {
+        case ENOSPC:
+        case EDQUOT:
+            return EMU_MEMORY_FULL;
+            break;
+
+        case ENOENT:
+        case ENOTDIR:
+        case EISDIR:
+        case EEXIST:
+        case ENOTEMPTY:
+        case EINVAL:
+            return EMU_INVALID_COMMAND;
+            break;
+
+        default:
+            return EMU_RUN_ERROR;
+    }
+}
+
+/* Wait for the host to answer a packet. Returns the command, or 0 if the
+   host has gone away. */
+static __u32 host_reply(int fd)
+{
+    if(0 >= get_tf_packet(fd, &in))
+    {
+        return 0;
+    }
+    return get_u32(&in.cmd);
+}
+
+/* Map a Toppy path such as \DataFiles\Movie.rec below the root directory.
+ * Returns freshly allocated memory, or NULL with errno set if the path
+ * would climb out of the root. */
+static char *local_path(const char *tfPath, size_t maxLen)
+{
+    size_t len = strnlen(tfPath, maxLen);
+    size_t rootLen = strlen(root);
+    char *path = malloc(rootLen + len + 2);
+    char *p;
+    char *name;
+
+    if(path == NULL)
+    {
+        return NULL;
+    }
+
+    strcpy(path, root);
+    p = path + rootLen;
+    *p = '/';
+    memcpy(p + 1, tfPath, len);
+    p[len + 1] = '\0';
+
+    for(p++; *p != '\0'; p++)
+    {
+        if(*p == '\\')
+        {
+            *p = '/';
+        }
+    }
+
+    for(name = path + rootLen + 1; name != NULL; name = strchr(name, '/'))
+    {
+        if(*name == '/')
+        {
+            name++;
+        }
+        if((0 == strncmp(name, "..", 2)) &&
+           ((name[2] == '\0') || (name[2] == '/')))
+        {
+            free(path);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    trace(2, fprintf(stderr, "%s -> %s\n", tfPath, path));
+    return path;
+}
+
+static void fill_typefile(struct typefile *tf, const char *name,
+                          const struct stat64 *st)
+{
+    memset(tf, 0, sizeof(*tf));
+    time_to_tfdt(st->st_mtime, &tf->stamp);
+    tf->filetype = S_ISDIR(st->st_mode) ? 1 : 2;
+    put_u64(&tf->size, S_ISDIR(st->st_mode) ? 0 : st->st_size);
+    strncpy((char *) tf->name, name, sizeof(tf->name) - 1);
+}
+
+static void do_size(int fd)
+{
+    struct statvfs vfs;
+    __u64 totalk;
+    __u64 freek;
+
+    if(0 != statvfs(root, &vfs))
+    {
+        send_fail(fd, errno_to_ecode(errno));
+        return;
+    }
+
+    totalk = (__u64) vfs.f_blocks * vfs.f_frsize / 1024;
+    freek = (__u64) vfs.f_bavail * vfs.f_frsize / 1024;
+    put_u16(&out.length, PACKET_HEAD_SIZE + 8);
+    put_u32(&out.cmd, DATA_HDD_SIZE);
+    put_u32(out.data, (totalk > 0xffffffffULL) ? 0xffffffff : totalk);
+    put_u32(&out.data[4], (freek > 0xffffffffULL) ? 0xffffffff : freek);
+    send_tf_packet(fd, &out);
+}
+
+#define DIR_ENTRIES (sizeof(out.data) / sizeof(struct typefile))
+
+/* Send the listing gathered so far and wait for the host to take it. An
+ * entry is held back if sending them all would make a packet that is a
+ * multiple of 0x200 bytes. Returns 0 if the host wants more. */
+static int send_dir_entries(int fd, struct typefile *entries, int *count)
+{
+    int n = *count;
+
+    if(((PACKET_HEAD_SIZE + n * sizeof(struct typefile)) % 0x200) == 0)
+    {
+        n--;
+    }
+
+    put_u16(&out.length, PACKET_HEAD_SIZE + n * sizeof(struct typefile));
+    put_u32(&out.cmd, DATA_HDD_DIR);
+    memcpy(out.data, entries, n * sizeof(struct typefile));
+    memmove(entries, &entries[n], (*count - n) * sizeof(struct typefile));
+    *count -= n;
+
+    if((0 > send_tf_packet(fd, &out)) || (SUCCESS != host_reply(fd)))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void do_dir(int fd, const struct tf_packet *req)
+{
+    static struct typefile entries[DIR_ENTRIES + 1];
+    char *path = local_path((char *) req->data,
+                            get_u16(&req->length) - PACKET_HEAD_SIZE);
+    struct dirent *de;
+    struct stat64 st;
+    DIR *dir;
+    int count = 0;
+
+    dir = (path != NULL) ? opendir(path) : NULL;
+    if((dir == NULL) || (0 != fstat64(dirfd(dir), &st)))
+    {
+        send_fail(fd, errno_to_ecode(errno));
+        goto out;
+    }
+
+    /* The Toppy lists the parent, but not the directory itself */
+    fill_typefile(&entries[count++], "..", &st);
+
+    while((de = readdir(dir)) != NULL)
+    {
+        if((0 == strcmp(de->d_name, ".")) || (0 == strcmp(de->d_name, "..")))
+        {
+            continue;
+        }
+
+        if((0 != fstatat64(dirfd(dir), de->d_name, &st, 0)) ||
+           !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+        {
+            continue;
+        }
+
+        fill_typefile(&entries[count++], de->d_name, &st);
+        if((count == (int) DIR_ENTRIES) &&
+           (0 != send_dir_entries(fd, entries, &count)))
+        {
+            goto out;
+        }
+    }
+
+    while(count > 0)
+    {
+        if(0 != send_dir_entries(fd, entries, &count))
+        {
+            goto out;
+        }
+    }
+    send_simple(fd, DATA_HDD_DIR_END);
+
+  out:
+    if(dir != NULL)
+    {
+        closedir(dir);
+    }
+    free(path);
+}
+
+/* The host has cancelled a transfer. */
+static void cancelled(int fd)
+{
+    trace(1, fprintf(stderr, "Transfer cancelled\n"));
+    send_simple(fd, SUCCESS);
+    start_drain();
+}
+
+static void file_get(int fd, const char *path, __u64 offset)
+{
+    struct typefile *tf = (struct typefile *) out.data;
+    struct stat64 st;
+    const char *name = strrchr(path, '/') + 1;
+    __u64 pos;
+    __u32 r;
+    int src;
+
+    src = open64(path, O_RDONLY);
+    if((src < 0) || (0 != fstat64(src, &st)) || !S_ISREG(st.st_mode))
+    {
+        send_fail(fd, (src < 0) ? errno_to_ecode(errno) : EMU_INVALID_COMMAND);
+        goto out;
+    }
+
+    posix_fadvise64(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    put_u16(&out.length, PACKET_HEAD_SIZE + sizeof(struct typefile));
+    put_u32(&out.cmd, DATA_HDD_FILE_START);
+    fill_typefile(tf, name, &st);
+    if(0 > send_tf_packet(fd, &out))
+    {
+        goto out;
+    }
+
+    pos = (offset < (__u64) st.st_size) ? offset : (__u64) st.st_size;
+    for(r = host_reply(fd); r == SUCCESS; r = host_reply(fd))
+    {
+        ssize_t w = sizeof(out.data) - 9;
+        ssize_t got;
+
+        if(pos >= (__u64) st.st_size)
+        {
+            send_simple(fd, DATA_HDD_FILE_END);
+            r = host_reply(fd);
+            break;
+        }
+
+        if((__u64) w > st.st_size - pos)
+        {
+            w = st.st_size - pos;
+        }
+
+        /* The Toppy never sends a packet that is a multiple of 0x200 */
+        if((w > 4) &&
+           (((((PACKET_HEAD_SIZE + 8 + w) + 1) & ~1) % 0x200) == 0))
+        {
+            w -= 4;
+        }
+
+        got = pread64(src, &out.data[8], w, pos);
+        if(got <= 0)
+        {
+            send_fail(fd, EMU_RUN_ERROR);
+            goto out;
+        }
+
+        put_u16(&out.length, PACKET_HEAD_SIZE + 8 + got);
+        put_u32(&out.cmd, DATA_HDD_FILE_DATA);
+        put_u64(out.data, pos);
+        if(0 > send_tf_packet(fd, &out))
+        {
+            goto out;
+        }
+        pos += got;
+    }
+
+    if(r == CANCEL)
+    {
+        cancelled(fd);
+    }
+
+  out:
+    if(src >= 0)
+    {
+        close(src);
+    }
+}
+
+static void file_put(int fd, const char *path, __u64 offset, int hasOffset)
+{
+    struct utimbuf times = { 0, 0 };
+    struct stat64 st;
+    int done = 0;
+    int ok = 0;
+    int dst;
+
+    dst = open64(path, O_WRONLY | O_CREAT | (hasOffset ? 0 : O_TRUNC), 0666);
+    if(dst < 0)
+    {
+        send_fail(fd, errno_to_ecode(errno));
+        return;
+    }
+
+    /* Resume by keeping what is already there up to the offset */
+    if(hasOffset && ((0 != fstat64(dst, &st)) ||
+                     ((__u64) st.st_size < offset) ||
+                     (0 != ftruncate64(dst, offset))))
+    {
+        send_fail(fd, EMU_INVALID_COMMAND);
+        close(dst);
+        return;
+    }
+
+    send_simple(fd, SUCCESS);
+
+    /* get_tf_packet has already answered each data packet */
+    while(!stopping && !done)
+    {
+        switch (host_reply(fd))
+        {
+            case DATA_HDD_FILE_START:
+            {
+                struct typefile *tf = (struct typefile *) in.data;
+
+                times.actime = times.modtime = tfdt_to_time(&tf->stamp);
+                send_simple(fd, SUCCESS);
+                break;
+            }
+
+            case DATA_HDD_FILE_DATA:
+            {
+                __u64 at = get_u64(in.data);
+                __u16 dataLen = get_u16(&in.length) - (PACKET_HEAD_SIZE + 8);
+
+                if(dataLen != pwrite64(dst, &in.data[8], dataLen, at))
+                {
+                    send_fail(fd, errno_to_ecode(errno));
+                    start_drain();
+                    done = 1;
+                }
+                break;
+            }
+
+            case DATA_HDD_FILE_END:
+                ok = 1;
+                done = 1;
+                break;
+
+            case CANCEL:
+                cancelled(fd);
+                done = 1;
+                break;
+
+            case 0:
+                done = 1;
+                break;
+
+            default:
+                send_fail(fd, EMU_INVALID_COMMAND);
+                done = 1;
+        }
+    }
+
+    /* Like the device, keep the stamp from the start of the transfer even
+       on a partial file, so that the put can be resumed. */
+    close(dst);
+    if(times.modtime != 0)
+    {
+        utime(path, &times);
+    }
+    if(ok)
+    {
+        send_simple(fd, SUCCESS);
+    }
+}
+
+static void do_file_send(int fd, const struct tf_packet *req)
+{
+    __u16 len = get_u16(&req->length);
+    __u8 dir = req->data[0];
+    __u16 pathLen = get_u16(&req->data[1]);
+    __u64 offset = 0;
+    int hasOffset = 0;
+    char *path;
+
+    if(PACKET_HEAD_SIZE + 3 + pathLen > len)
+    {
+        send_fail(fd, EMU_INVALID_COMMAND);
+        return;
+    }
+
+    if(PACKET_HEAD_SIZE + 3 + pathLen + 8 <= len)
+    {
+        offset = get_u64(&req->data[3 + pathLen]);
+        hasOffset = 1;
+    }
+
+    path = local_path((char *) &req->data[3], pathLen);
+    if(path == NULL)
+    {
+        send_fail(fd, EMU_INVALID_COMMAND);
+        return;
+    }
+
+    trace(1, fprintf(stderr, "%s %s from %llu\n", (dir == GET) ? "Get" : "Put",
+                     path, offset));
+    if(dir == GET)
+    {
+        file_get(fd, path, offset);
+    }
+    else if(dir == PUT)
+    {
+        file_put(fd, path, offset, hasOffset);
+    }
+    else
+    {
+        send_fail(fd, EMU_INVALID_COMMAND);
+    }
+    free(path);
+}
+
+static void do_del(int fd, const struct tf_packet *req)
+{
+    char *path = local_path((char *) req->data,
+                            get_u16(&req->length) - PACKET_HEAD_SIZE);
+    struct stat64 st;
+    int r = -1;
+
+    if((path != NULL) && (0 == stat64(path, &st)))
+    {
+        r = S_ISDIR(st.st_mode) ? rmdir(path) : unlink(path);
+    }
+
+    if(r == 0)
+    {
+        send_simple(fd, SUCCESS);
+    }
+    else
+    {
+        send_fail(fd, errno_to_ecode(errno));
+    }
+    free(path);
+}
+
+static void do_rename(int fd, const struct tf_packet *req)
+{
+    __u16 len = get_u16(&req->length) - PACKET_HEAD_SIZE;
+    __u16 srcLen = get_u16(req->data);
+    __u16 dstLen = (2 + srcLen + 2 <= len) ?
+        get_u16(&req->data[2 + srcLen]) : 0;
+    char *src = NULL;
+    char *dst = NULL;
+
+    errno = EINVAL;
+    if((2 + srcLen + 2 + dstLen) <= len)
+    {
+        src = local_path((char *) &req->data[2], srcLen);
+        dst = local_path((char *) &req->data[2 + srcLen + 2], dstLen);
+    }
+
+    if((src != NULL) && (dst != NULL) && (0 == rename(src, dst)))
+    {
+        send_simple(fd, SUCCESS);
+    }
+    else
+    {
+        send_fail(fd, errno_to_ecode(errno));
+    }
+    free(src);
+    free(dst);
+}
+
+static void do_create_dir(int fd, const struct tf_packet *req)
+{
+    __u16 len = get_u16(&req->length) - PACKET_HEAD_SIZE;
+    __u16 pathLen = get_u16(req->data);
+    char *path = NULL;
+
+    errno = EINVAL;
+    if(2 + pathLen <= len)
+    {
+        path = local_path((char *) &req->data[2], pathLen);
+    }
+
+    if((path != NULL) && (0 == mkdir(path, 0777)))
+    {
+        send_simple(fd, SUCCESS);
+    }
+    else
+    {
+        send_fail(fd, errno_to_ecode(errno));
+    }
+    free(path);
+}
+
+/* Answer requests from one client until it goes away. */
+static void serve_client(int fd)
+{
+    struct pollfd pfd;
+
+    usb_probe_capabilities(fd);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while(!stopping)
+    {
+        /* A client may sit idle for as long as it likes */
+        if(0 >= poll(&pfd, 1, -1))
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        if(0 >= get_tf_packet(fd, &in))
+        {
+            break;
+        }
+
+        switch (get_u32(&in.cmd))
+        {
+            case CMD_READY:
+            case CMD_RESET:
+            case CMD_TURBO:
+                send_simple(fd, SUCCESS);
+                break;
+
+            case CMD_HDD_SIZE:
+                do_size(fd);
+                break;
+
+            case CMD_HDD_DIR:
+                do_dir(fd, &in);
+                break;
+
+            case CMD_HDD_FILE_SEND:
+                do_file_send(fd, &in);
+                break;
+
+            case CMD_HDD_DEL:
+                do_del(fd, &in);
+                break;
+
+            case CMD_HDD_RENAME:
+                do_rename(fd, &in);
+                break;
+
+            case CMD_HDD_CREATE_DIR:
+                do_create_dir(fd, &in);
+                break;
+
+            case SUCCESS:
+            case DATA_HDD_FILE_DATA:
+                /* Stragglers from a transfer that has already ended */
+                break;
+
+            case CANCEL:
+                if(!draining())
+                {
+                    send_simple(fd, SUCCESS);
+                }
+                break;
+
+            default:
+                send_fail(fd, EMU_UNKNOWN_COMMAND);
+        }
+    }
+}
+
+static void usage(char *myName)
+{
+    fprintf(stderr,
+            "Usage: %s [-pPv] <socket> <directory>\n"
+            " -p             - packet header output to stderr\n"
+            " -P             - full packet dump output to stderr\n"
+            " -v             - verbose output to stderr\n"
+            " <socket>       - Unix socket to serve, for puppy -d unix:<socket>\n"
+            " <directory>    - local directory that stands in for the hard disk\n",
+            myName);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat64 st;
+    const char *engine;
+    char *sockPath;
+    int lfd;
+    int c;
+
+    while((c = getopt(argc, argv, "pPv")) != -1)
+    {
+        switch (c)
+        {
+            case 'p':
+                packet_trace = 1;
+                break;
+
+            case 'P':
+                packet_trace = 2;
+                break;
+
+            case 'v':
+                verbose++;
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(argc - optind != 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sockPath = argv[optind];
+    root = argv[optind + 1];
+    if((0 != stat64(root, &st)) || !S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "ERROR: %s is not a directory\n", root);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(sockPath) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "ERROR: Socket path %s is too long\n", sockPath);
+        return 1;
+    }
+    strcpy(addr.sun_path, sockPath);
+
+    engine = byte_swap_init();
+    trace(1, fprintf(stderr, "Byte swap: %s\n", engine));
+    engine = crc16_init();
+    trace(1, fprintf(stderr, "CRC engine: %s\n", engine));
+
+    lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if((lfd < 0) ||
+       (0 != bind(lfd, (struct sockaddr *) &addr, sizeof(addr))) ||
+       (0 != listen(lfd, 4)))
+    {
+        fprintf(stderr, "ERROR: Can not listen on %s: %s\n", sockPath,
+                strerror(errno));
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = emu_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    trace(1, fprintf(stderr, "Emulating a Toppy on %s, serving %s\n",
+                     sockPath, root));
+
+    while(!stopping)
+    {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+        if(fd < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "ERROR: Can not accept connection: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        trace(1, fprintf(stderr, "Client connected\n"));
+        transport_attach(fd, &socket_transport);
+        serve_client(fd);
+        transport_detach(fd);
+        close(fd);
+        trace(1, fprintf(stderr, "Client disconnected\n"));
+    }
+
+    close(lfd);
+    unlink(sockPath);
+    return stopping ? 0 : 1;
+}
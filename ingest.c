@@ -0,0 +1,638 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ingest.h"
+#include "tf_bytes.h"
+
+/* Received file data is handed over here once the packet has been
+ * acknowledged. The worker thread optionally checks the packet CRC and then
+ * writes the payload to the destination file. Neither the hashing nor the
+ * disk write sits between one USB read and the next; the USB loop only
+ * waits when the ring is full.
+ *
+ * Where the kernel has io_uring, the worker does not block on each write.
+ * Everything waiting in the ring is submitted in one batch of linked
+ * writes at the file offsets carried in the packets, and completions are
+ * reaped in batches. Slots go back to the USB loop in order as their writes
+ * complete. Otherwise each packet is written with pwrite().
+ *
+ * If the destination was opened with O_DIRECT, payloads are gathered in an
+ * aligned staging buffer and written out in aligned blocks instead, so the
+ * data bypasses the page cache. Pieces that can not be aligned, such as the
+ * odd-sized tail of the file, are written with O_DIRECT switched off.
+ */
+
+static void fail(struct ingest *in)
+{
+    pthread_mutex_lock(&in->lock);
+    in->failed = 1;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+}
+
+static void check_packet(struct ingest *in, struct tf_packet *packet)
+{
+    __u16 crc = get_u16(&packet->crc);
+    __u16 calc_crc = get_crc(packet);
+
+    if(crc != calc_crc)
+    {
+        fprintf(stderr,
+                "\n%s: Packet CRC %04x, expected %04x at offset %llu\n",
+                in->strict ? "ERROR" : "WARNING", crc, calc_crc,
+                get_u64(packet->data));
+
+        pthread_mutex_lock(&in->lock);
+        in->crcErrors++;
+        pthread_mutex_unlock(&in->lock);
+
+        if(in->strict)
+        {
+            fail(in);
+        }
+    }
+}
+
+static void write_packet(struct ingest *in, struct tf_packet *packet)
+{
+    __u8 *data = &packet->data[8];
+    ssize_t dataLen = get_u16(&packet->length) - (PACKET_HEAD_SIZE + 8);
+    __u64 offset = get_u64(packet->data);
+
+    while(dataLen > 0)
+    {
+        ssize_t w = in->stream ? write(in->dst, data, dataLen) :
+            pwrite64(in->dst, data, dataLen, offset);
+
+        if(w < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            fprintf(stderr, "\nERROR: Can not write data: %s\n",
+                    strerror(errno));
+            fail(in);
+            return;
+        }
+
+        data += w;
+        dataLen -= w;
+        offset += w;
+    }
+}
+
+/* Write out the part of a slot that io_uring did not. */
+static void finish_slot(struct ingest *in, int slot, int written)
+{
+    __u8 *data = (__u8 *) in->iov[slot].iov_base + written;
+    ssize_t dataLen = in->iov[slot].iov_len - written;
+    __u64 offset = in->offset[slot] + written;
+
+    while((dataLen > 0) && !ingest_failed(in))
+    {
+        ssize_t w = pwrite64(in->dst, data, dataLen, offset);
+
+        if(w < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            fprintf(stderr, "\nERROR: Can not write data: %s\n",
+                    strerror(errno));
+            fail(in);
+            return;
+        }
+
+        data += w;
+        dataLen -= w;
+        offset += w;
+    }
+}
+
+/* A submission has failed, so the ring can not be trusted any more. No slot
+ * may be released while the kernel could still be writing from it: writes
+ * it never picked up are taken back and the rest are waited for. If even
+ * waiting fails, the ring is torn down to cancel whatever is left.
+ */
+static void abandon_ring(struct ingest *in, int inflight)
+{
+    __u64 taken[INGEST_SLOTS];
+    __u64 userData;
+    int res;
+    int r;
+
+    inflight -= uring_unqueue(&in->ring, taken, INGEST_SLOTS);
+    while(inflight > 0)
+    {
+        while(uring_reap(&in->ring, &userData, &res))
+        {
+            inflight--;
+        }
+
+        if(inflight > 0)
+        {
+            r = uring_submit(&in->ring, 1);
+            if((r < 0) && (r != -EAGAIN) && (r != -EBUSY))
+            {
+                trace(1, fprintf(stderr, "Can not wait for io_uring: %s\n",
+                                 strerror(-r)));
+                uring_exit(&in->ring);
+                break;
+            }
+        }
+    }
+}
+
+static void ingest_worker_uring(struct ingest *in)
+{
+    int queued = 0;             /* slots from head handed to the kernel */
+    int inflight = 0;           /* writes the kernel has not completed */
+
+    pthread_mutex_lock(&in->lock);
+    for(;;)
+    {
+        int fresh;
+        int first;
+        int i;
+        int r;
+        __u64 userData;
+        int res;
+
+        while((in->count == 0) && !in->closed)
+        {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+
+        if(in->count == 0)
+        {
+            break;
+        }
+
+        fresh = in->count - queued;
+        first = (in->head + queued) % INGEST_SLOTS;
+        pthread_mutex_unlock(&in->lock);
+
+        for(i = 0; i < fresh; i++)
+        {
+            int slot = (first + i) % INGEST_SLOTS;
+            struct tf_packet *packet = &in->slots[slot];
+
+            if(in->checkCrc)
+            {
+                check_packet(in, packet);
+            }
+
+            in->iov[slot].iov_base = &packet->data[8];
+            in->iov[slot].iov_len =
+                get_u16(&packet->length) - (PACKET_HEAD_SIZE + 8);
+            in->offset[slot] = get_u64(packet->data);
+
+            if(ingest_failed(in) ||
+               (0 != uring_queue_writev(&in->ring, in->dst, &in->iov[slot],
+                                        in->offset[slot], slot,
+                                        i + 1 < fresh)))
+            {
+                in->done[slot] = 1;
+            }
+            else
+            {
+                inflight++;
+            }
+        }
+        queued += fresh;
+
+        /* Only block in the kernel when there is nothing new to queue. Once
+           the ring has been given up there is nothing left to submit. */
+        r = 0;
+        if(inflight > 0)
+        {
+            r = uring_submit(&in->ring, (fresh == 0) ? 1 : 0);
+        }
+        if(r < 0)
+        {
+            fprintf(stderr, "\nERROR: io_uring submission failed: %s\n",
+                    strerror(-r));
+            fail(in);
+            abandon_ring(in, inflight);
+        }
+
+        while(uring_reap(&in->ring, &userData, &res))
+        {
+            int slot = (int) userData;
+
+            inflight--;
+
+            /* A short write breaks the link and cancels the writes after
+               it, so those are completed by hand as well. */
+            if(res == -ECANCELED)
+            {
+                res = 0;
+            }
+
+            if(res < 0)
+            {
+                fprintf(stderr, "\nERROR: Can not write data: %s\n",
+                        strerror(-res));
+                fail(in);
+            }
+            else if((size_t) res < in->iov[slot].iov_len)
+            {
+                finish_slot(in, slot, res);
+            }
+
+            in->done[slot] = 1;
+        }
+
+        pthread_mutex_lock(&in->lock);
+
+        /* The kernel is done with every slot, so they can all go */
+        if(r < 0)
+        {
+            for(i = 0; i < queued; i++)
+            {
+                in->done[(in->head + i) % INGEST_SLOTS] = 1;
+            }
+            inflight = 0;
+        }
+
+        while((queued > 0) && in->done[in->head])
+        {
+            in->done[in->head] = 0;
+            in->head = (in->head + 1) % INGEST_SLOTS;
+            in->count--;
+            queued--;
+        }
+        pthread_cond_broadcast(&in->cond);
+    }
+    pthread_mutex_unlock(&in->lock);
+}
+
+static int set_direct(struct ingest *in, int direct)
+{
+    int flags = fcntl(in->dst, F_GETFL);
+
+    if(direct == in->direct)
+    {
+        return 0;
+    }
+
+    flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if(0 != fcntl(in->dst, F_SETFL, flags))
+    {
+        return -1;
+    }
+
+    in->direct = direct;
+    return 0;
+}
+
+/* Write out the staging buffer. Unless final is set, only whole aligned
+ * blocks are written and the remainder is kept for later. A run that starts
+ * part way into a block, as a resumed get does, first writes up to the next
+ * block boundary so that the rest of it can go out aligned.
+ */
+static void stage_flush(struct ingest *in, int final)
+{
+    size_t head = (DIRECT_ALIGN - (in->stageOffset % DIRECT_ALIGN)) %
+        DIRECT_ALIGN;
+    size_t n;
+    size_t done = 0;
+    int aligned;
+
+    if(final)
+    {
+        n = in->stageLen;
+    }
+    else if(head > 0)
+    {
+        n = MIN(head, in->stageLen);
+    }
+    else
+    {
+        n = in->stageLen & ~(DIRECT_ALIGN - 1);
+    }
+    aligned = (head == 0) && ((n % DIRECT_ALIGN) == 0);
+
+    if(n == 0)
+    {
+        return;
+    }
+
+    if(0 != set_direct(in, aligned))
+    {
+        fprintf(stderr, "\nERROR: Can not change O_DIRECT mode: %s\n",
+                strerror(errno));
+        fail(in);
+        return;
+    }
+
+    while(done < n)
+    {
+        ssize_t w = pwrite64(in->dst, in->stage + done, n - done,
+                             in->stageOffset + done);
+
+        if(w < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            fprintf(stderr, "\nERROR: Can not write data: %s\n",
+                    strerror(errno));
+            fail(in);
+            return;
+        }
+        done += w;
+    }
+
+    memmove(in->stage, in->stage + n, in->stageLen - n);
+    in->stageLen -= n;
+    in->stageOffset += n;
+}
+
+static void stage_packet(struct ingest *in, struct tf_packet *packet)
+{
+    __u8 *data = &packet->data[8];
+    size_t dataLen = get_u16(&packet->length) - (PACKET_HEAD_SIZE + 8);
+    __u64 offset = get_u64(packet->data);
+
+    /* Start a new run if the data does not follow on. */
+    if(offset != in->stageOffset + in->stageLen)
+    {
+        stage_flush(in, 1);
+        in->stageOffset = offset;
+    }
+
+    while((dataLen > 0) && !ingest_failed(in))
+    {
+        size_t n = MIN(dataLen, DIRECT_STAGE - in->stageLen);
+
+        memcpy(in->stage + in->stageLen, data, n);
+        in->stageLen += n;
+        data += n;
+        dataLen -= n;
+
+        if(in->stageLen == DIRECT_STAGE)
+        {
+            stage_flush(in, 0);
+        }
+    }
+}
+
+static void *ingest_worker(void *arg)
+{
+    struct ingest *in = arg;
+
+    if(in->useUring)
+    {
+        ingest_worker_uring(in);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&in->lock);
+    for(;;)
+    {
+        struct tf_packet *packet;
+
+        while((in->count == 0) && !in->closed)
+        {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+
+        if(in->count == 0)
+        {
+            break;
+        }
+
+        packet = &in->slots[in->head];
+        pthread_mutex_unlock(&in->lock);
+
+        /* After a failure keep draining, but stop writing. */
+        if(in->checkCrc)
+        {
+            check_packet(in, packet);
+        }
+        if(!ingest_failed(in))
+        {
+            if(in->stage != NULL)
+            {
+                stage_packet(in, packet);
+            }
+            else
+            {
+                write_packet(in, packet);
+            }
+        }
+
+        pthread_mutex_lock(&in->lock);
+        in->head = (in->head + 1) % INGEST_SLOTS;
+        in->count--;
+        pthread_cond_broadcast(&in->cond);
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    if((in->stage != NULL) && !ingest_failed(in))
+    {
+        stage_flush(in, 1);
+    }
+
+    return NULL;
+}
+
+int ingest_start(struct ingest *in, int dst, int checkCrc, int strict)
+{
+    int r;
+
+    memset(in, 0, sizeof(*in));
+    in->ring.fd = -1;
+    in->dst = dst;
+    in->checkCrc = checkCrc;
+    in->strict = strict;
+
+    in->slots = malloc(INGEST_SLOTS * sizeof(struct tf_packet));
+    if(in->slots == NULL)
+    {
+        fprintf(stderr, "ERROR: Can not allocate ingest buffers\n");
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
+
+    in->stream = (lseek64(dst, 0, SEEK_CUR) < 0) && (errno == ESPIPE);
+    in->direct = (fcntl(dst, F_GETFL) & O_DIRECT) ? 1 : 0;
+    if(in->stream)
+    {
+        /* Pipes have no offsets to write at */
+        in->direct = 0;
+        in->useUring = 0;
+        trace(1, fprintf(stderr, "Writing file data to a pipe\n"));
+    }
+    else if(in->direct)
+    {
+        r = posix_memalign((void **) &in->stage, DIRECT_ALIGN, DIRECT_STAGE);
+        if(r != 0)
+        {
+            fprintf(stderr, "ERROR: Can not allocate staging buffer\n");
+            pthread_cond_destroy(&in->cond);
+            pthread_mutex_destroy(&in->lock);
+            free(in->slots);
+            in->slots = NULL;
+            return -r;
+        }
+
+        in->useUring = 0;
+        trace(1, fprintf(stderr, "Writing file data with O_DIRECT\n"));
+    }
+    else
+    {
+        r = uring_init(&in->ring, INGEST_SLOTS);
+        in->useUring = (r == 0);
+        trace(1, fprintf(stderr, "Writing file data with %s\n",
+                         in->useUring ? "io_uring" : "pwrite()"));
+        if(!in->useUring)
+        {
+            trace(2, fprintf(stderr, "io_uring unavailable: %s\n",
+                             strerror(-r)));
+        }
+    }
+
+    r = pthread_create(&in->thread, NULL, ingest_worker, in);
+    if(r != 0)
+    {
+        fprintf(stderr, "ERROR: Can not start ingest thread: %s\n",
+                strerror(r));
+        if(in->useUring)
+        {
+            uring_exit(&in->ring);
+        }
+        free(in->stage);
+        in->stage = NULL;
+        pthread_cond_destroy(&in->cond);
+        pthread_mutex_destroy(&in->lock);
+        free(in->slots);
+        in->slots = NULL;
+        return -r;
+    }
+
+    return 0;
+}
+
+/* Queue a copy of a received packet for the worker.
+ * Blocks while the ring is full. Returns a negative number if the worker
+ * has failed and the transfer should be abandoned.
+ */
+int ingest_push(struct ingest *in, const struct tf_packet *packet)
+{
+    int slot;
+
+    pthread_mutex_lock(&in->lock);
+    while((in->count == INGEST_SLOTS) && !in->failed)
+    {
+        pthread_cond_wait(&in->cond, &in->lock);
+    }
+
+    if(in->failed)
+    {
+        pthread_mutex_unlock(&in->lock);
+        return -1;
+    }
+
+    slot = (in->head + in->count) % INGEST_SLOTS;
+    pthread_mutex_unlock(&in->lock);
+
+    /* Only the worker moves head, and it never touches this slot until
+       count says so. */
+    memcpy(&in->slots[slot], packet, get_u16(&packet->length));
+
+    pthread_mutex_lock(&in->lock);
+    in->count++;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+
+    return 0;
+}
+
+int ingest_failed(struct ingest *in)
+{
+    int failed;
+
+    pthread_mutex_lock(&in->lock);
+    failed = in->failed;
+    pthread_mutex_unlock(&in->lock);
+
+    return failed;
+}
+
+/* Wait for the worker to drain the ring and release everything.
+ * Returns a negative number if any queued packet failed. Calling this again
+ * just returns the same result.
+ */
+int ingest_finish(struct ingest *in)
+{
+    if(in->slots == NULL)
+    {
+        return in->failed ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&in->lock);
+    in->closed = 1;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+
+    pthread_join(in->thread, NULL);
+
+    /* Pipe and O_DIRECT destinations never set up a ring */
+    if(in->useUring)
+    {
+        uring_exit(&in->ring);
+    }
+    free(in->stage);
+    in->stage = NULL;
+    pthread_cond_destroy(&in->cond);
+    pthread_mutex_destroy(&in->lock);
+    free(in->slots);
+    in->slots = NULL;
+
+    if(in->crcErrors)
+    {
+        fprintf(stderr, "%s: %lu packets failed the CRC check\n",
+                in->strict ? "ERROR" : "WARNING", in->crcErrors);
+    }
+
+    return in->failed ? -1 : 0;
+}
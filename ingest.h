@@ -0,0 +1,83 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _INGEST_H
+#define _INGEST_H 1
+
+#include <pthread.h>
+#include <sys/uio.h>
+#include "usb_io.h"
+#include "uring.h"
+
+/* Number of packets that can be queued for the worker thread.
+   32 packets is about 2 MiB, enough to ride out a slow disk for a while. */
+#define INGEST_SLOTS 32
+
+/* O_DIRECT writes go through a staging buffer of this size, aligned to and
+   flushed in multiples of DIRECT_ALIGN. */
+#define DIRECT_STAGE (1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+/* A bounded ring of received DATA_HDD_FILE_DATA packets, drained by a
+ * worker thread that writes them out, so that the USB loop does not wait
+ * on the local disk.
+ */
+struct ingest
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+
+    struct tf_packet *slots;
+    int head;                   /* next slot for the worker */
+    int count;                  /* slots waiting for the worker */
+    int closed;
+
+    int dst;                    /* destination file */
+    int stream;                 /* destination is a pipe, written in order */
+    int checkCrc;               /* verify packet CRCs before writing */
+    int strict;                 /* fail the transfer on a CRC mismatch */
+    int failed;
+    unsigned long crcErrors;
+
+    /* O_DIRECT staging, used only by the worker */
+    __u8 *stage;
+    size_t stageLen;
+    __u64 stageOffset;
+    int direct;
+
+    /* io_uring state, used only by the worker */
+    int useUring;
+    struct uring ring;
+    struct iovec iov[INGEST_SLOTS];
+    __u64 offset[INGEST_SLOTS];
+    unsigned char done[INGEST_SLOTS];
+};
+
+int ingest_start(struct ingest *in, int dst, int checkCrc, int strict);
+int ingest_push(struct ingest *in, const struct tf_packet *packet);
+int ingest_failed(struct ingest *in);
+int ingest_finish(struct ingest *in);
+
+#endif /* _INGEST_H */
@@ -0,0 +1,771 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include "libpuppy.h"
+#include "usb_io.h"
+#include "byte_swap.h"
+#include "crc16.h"
+#include "transport.h"
+
+#define PUT 0
+#define GET 1
+#define TOPPYVID 0x11db
+#define TOPPYPID 0x1000
+
+/* Progress is reported once every this many packets */
+#define PROGRESS_PACKETS 16
+
+struct puppy
+{
+    pthread_mutex_t lock;
+    int fd;
+    pthread_t thread;           /* the last thread to use the device */
+    int bound;
+    char error[64];
+    struct usb_io_settings io;  /* CRC and trace settings, packet errors */
+    struct usb_io_settings *outer;      /* settings of an enclosing call */
+    struct tf_packet packet;
+    struct tf_packet reply;
+};
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+static void init_engines(void)
+{
+    byte_swap_init();
+    crc16_init();
+}
+
+/* Take the handle for a call. The usbfs transfer limits are kept per
+ * thread, so a thread that is new to this device asks for them again. */
+static void enter(struct puppy *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->error[0] = '\0';
+    p->io.error = 0;
+    p->io.errorText[0] = '\0';
+    p->outer = usb_io_use(&p->io);
+    if(!p->bound || !pthread_equal(p->thread, pthread_self()))
+    {
+        usb_probe_capabilities(p->fd);
+        p->thread = pthread_self();
+        p->bound = 1;
+    }
+}
+
+/* Give up the handle. A failure in the packet layer, such as a CRC
+ * mismatch or a transport error, is more telling than a plain -EPROTO,
+ * and is never allowed to pass as success. */
+static int leave(struct puppy *p, int r)
+{
+    if(p->io.error != 0)
+    {
+        if((r == 0) || (r == -EPROTO))
+        {
+            r = p->io.error;
+        }
+        if(p->error[0] == '\0')
+        {
+            snprintf(p->error, sizeof(p->error), "%s", p->io.errorText);
+        }
+    }
+
+    usb_io_use(p->outer);
+    pthread_mutex_unlock(&p->lock);
+    return r;
+}
+
+static int device_error(struct puppy *p, const struct tf_packet *reply)
+{
+    snprintf(p->error, sizeof(p->error), "%s", decode_error(reply));
+    return -EPROTO;
+}
+
+static int unexpected(struct puppy *p, const struct tf_packet *reply)
+{
+    snprintf(p->error, sizeof(p->error), "Unexpected packet 0x%x",
+             get_u32(&reply->cmd));
+    return -EPROTO;
+}
+
+/* Finish a request that is answered by a single SUCCESS or FAIL */
+static int simple_request(struct puppy *p, ssize_t sent)
+{
+    if((sent < 0) || (get_tf_packet(p->fd, &p->reply) < 0))
+    {
+        return -EPROTO;
+    }
+
+    switch (get_u32(&p->reply.cmd))
+    {
+        case SUCCESS:
+            return 0;
+            break;
+
+        case FAIL:
+            return device_error(p, &p->reply);
+            break;
+
+        default:
+            return unexpected(p, &p->reply);
+    }
+}
+
+/* Open, reset and claim the Toppy at devPath. */
+static int open_handle(const char *devPath, struct puppy **handle)
+{
+    struct usb_device_descriptor desc;
+    struct usbdevfs_setinterface interface0 = { 0, 0 };
+    int interface = 0;
+    int fd;
+    int r;
+
+    *handle = NULL;
+
+    /* An emulated Toppy needs no reset or claiming */
+    if(transport_is_path(devPath))
+    {
+        fd = transport_connect(devPath);
+        if(fd < 0)
+        {
+            return fd;
+        }
+
+        r = puppy_attach(fd, handle);
+        if(r != 0)
+        {
+            transport_detach(fd);
+            close(fd);
+        }
+        return r;
+    }
+
+    fd = open(devPath, O_RDWR);
+    if(fd < 0)
+    {
+        return -errno;
+    }
+
+    if(0 != flock(fd, LOCK_EX | LOCK_NB))
+    {
+        r = -EBUSY;
+    }
+    else if(read_device_descriptor(fd, &desc) < 0)
+    {
+        r = -EIO;
+    }
+    else if((desc.idVendor != TOPPYVID) || (desc.idProduct != TOPPYPID))
+    {
+        r = -ENODEV;
+    }
+    else if((ioctl(fd, USBDEVFS_RESET, NULL) < 0) ||
+            (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0) ||
+            (ioctl(fd, USBDEVFS_SETINTERFACE, &interface0) < 0))
+    {
+        r = -errno;
+    }
+    else
+    {
+        r = puppy_attach(fd, handle);
+    }
+
+    if(r != 0)
+    {
+        close(fd);
+    }
+    return r;
+}
+
+int puppy_open(const char *devPath, struct puppy **handle)
+{
+    struct usb_io_settings quiet;
+    struct usb_io_settings *outer;
+    int r;
+
+    /* There is no handle to report through yet, so keep the protocol code
+       quiet and go by the result alone. */
+    memset(&quiet, 0, sizeof(quiet));
+    outer = usb_io_use(&quiet);
+    r = open_handle(devPath, handle);
+    usb_io_use(outer);
+    return r;
+}
+
+/* Make a handle for a device that is already open and claimed. The handle
+ * takes over fd. */
+int puppy_attach(int fd, struct puppy **handle)
+{
+    struct puppy *p;
+
+    pthread_once(&initOnce, init_engines);
+
+    p = calloc(1, sizeof(*p));
+    if(p == NULL)
+    {
+        *handle = NULL;
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    p->fd = fd;
+    *handle = p;
+    return 0;
+}
+
+void puppy_close(struct puppy *p)
+{
+    int interface = 0;
+
+    if(p == NULL)
+    {
+        return;
+    }
+
+    if(transport_get(p->fd) != NULL)
+    {
+        transport_detach(p->fd);
+    }
+    else
+    {
+        ioctl(p->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+    }
+    close(p->fd);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+void puppy_ignore_crc(struct puppy *p, int ignore)
+{
+    pthread_mutex_lock(&p->lock);
+    p->io.ignoreCrc = ignore;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void puppy_trace_packets(struct puppy *p, int level)
+{
+    pthread_mutex_lock(&p->lock);
+    p->io.packetTrace = level;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Why the last call on this handle failed, or "" if it did not or the
+ * device gave no reason. Valid until the next call. */
+const char *puppy_error(struct puppy *p)
+{
+    return p->error;
+}
+
+int puppy_size(struct puppy *p, __u64 *totalBytes, __u64 *freeBytes)
+{
+    int r = -EPROTO;
+
+    enter(p);
+    if((send_cmd_hdd_size(p->fd) >= 0) &&
+       (get_tf_packet(p->fd, &p->reply) >= 0))
+    {
+        switch (get_u32(&p->reply.cmd))
+        {
+            case DATA_HDD_SIZE:
+                *totalBytes = get_u32(&p->reply.data) * 1024ULL;
+                *freeBytes = get_u32(&p->reply.data[4]) * 1024ULL;
+                r = 0;
+                break;
+
+            case FAIL:
+                r = device_error(p, &p->reply);
+                break;
+
+            default:
+                r = unexpected(p, &p->reply);
+        }
+    }
+    return leave(p, r);
+}
+
+int puppy_dir(struct puppy *p, const char *path, puppy_entry_fn entry,
+              void *ctx)
+{
+    int result = 0;
+
+    enter(p);
+    if(0 > send_cmd_hdd_dir(p->fd, path))
+    {
+        return leave(p, -EPROTO);
+    }
+
+    while(0 < get_tf_packet(p->fd, &p->reply))
+    {
+        switch (get_u32(&p->reply.cmd))
+        {
+            case DATA_HDD_DIR:
+            {
+                __u16 count =
+                    (get_u16(&p->reply.length) - PACKET_HEAD_SIZE) /
+                    sizeof(struct typefile);
+                struct typefile *entries = (struct typefile *) p->reply.data;
+                int i;
+
+                /* Entries from a packet that failed its CRC are dropped;
+                   the failure is returned once the listing is read. */
+                if(p->io.error != 0)
+                {
+                    count = 0;
+                }
+
+                for(i = 0; i < count; i++)
+                {
+                    struct puppy_entry e;
+                    int r;
+
+                    /* The name need not be terminated */
+                    entries[i].unused = 0;
+                    e.name = (char *) entries[i].name;
+                    e.type = entries[i].filetype;
+                    e.size = get_u64(&entries[i].size);
+                    e.mtime = tfdt_to_time(&entries[i].stamp);
+                    e.attrib = get_u32(&entries[i].attrib);
+
+                    r = entry(&e, ctx);
+                    if(result == 0)
+                    {
+                        result = r;
+                    }
+                }
+                send_success(p->fd);
+                break;
+            }
+
+            case DATA_HDD_DIR_END:
+                return leave(p, result);
+                break;
+
+            case FAIL:
+                device_error(p, &p->reply);
+                return leave(p, -ENOENT);
+                break;
+
+            default:
+                return leave(p, unexpected(p, &p->reply));
+        }
+    }
+    return leave(p, -EPROTO);
+}
+
+/* Get length bytes of a file from offset, or PUPPY_TO_END for the rest of
+ * it. The get is cancelled once the range has arrived. Data from before
+ * the offset, sent by firmware that ignores it, is passed over. */
+int puppy_get(struct puppy *p, const char *path, __u64 offset,
+              __u64 length, puppy_data_fn data, puppy_progress_fn progress,
+              void *ctx)
+{
+    struct tf_packet *pk = &p->reply;
+    int result = -EPROTO;
+    int toEnd = 0;
+    int first = 1;
+    int update = 0;
+    __u64 expect = offset;
+    __u64 got = 0;
+    ssize_t r;
+    enum
+    {
+        START,
+        DATA,
+        ABORT
+    } state;
+
+    enter(p);
+
+    /* Queue reads before asking for the file. Falls back to synchronous
+       reads. */
+    usb_read_queue_start(p->fd, 0x82);
+
+    if(offset > 0)
+    {
+        r = send_cmd_hdd_file_send_with_offset(p->fd, GET, path, offset);
+    }
+    else
+    {
+        r = send_cmd_hdd_file_send(p->fd, GET, path);
+    }
+    if(r < 0)
+    {
+        goto out;
+    }
+
+    state = START;
+    while(0 < (r = get_tf_packet_queued(p->fd, &p->reply, &pk)))
+    {
+        switch (get_u32(&pk->cmd))
+        {
+            case DATA_HDD_FILE_START:
+                if(state == START)
+                {
+                    struct typefile *tf = (struct typefile *) pk->data;
+                    __u64 size = get_u64(&tf->size);
+
+                    if((offset >= size) || (length == 0))
+                    {
+                        length = 0;
+                        result = 0;
+                        send_cancel(p->fd);
+                        state = ABORT;
+                        break;
+                    }
+                    if(length >= size - offset)
+                    {
+                        length = size - offset;
+                        toEnd = 1;
+                    }
+                    send_success(p->fd);
+                    state = DATA;
+                }
+                else
+                {
+                    result = unexpected(p, pk);
+                    send_cancel(p->fd);
+                    state = ABORT;
+                }
+                break;
+
+            case DATA_HDD_FILE_DATA:
+                if(state == DATA)
+                {
+                    __u64 at = get_u64(pk->data);
+                    __u16 dataLen =
+                        get_u16(&pk->length) - (PACKET_HEAD_SIZE + 8);
+                    __u64 skip;
+                    __u64 n;
+                    int rr;
+
+                    /* Never hand over data that failed its CRC */
+                    if(p->io.error != 0)
+                    {
+                        result = p->io.error;
+                        send_cancel(p->fd);
+                        state = ABORT;
+                        break;
+                    }
+
+                    if(first && (at < offset))
+                    {
+                        expect = at;
+                    }
+                    first = 0;
+
+                    if(at != expect)
+                    {
+                        snprintf(p->error, sizeof(p->error),
+                                 "File data at %llu, expected %llu", at,
+                                 expect);
+                        send_cancel(p->fd);
+                        state = ABORT;
+                        break;
+                    }
+                    expect = at + dataLen;
+                    if(expect <= offset)
+                    {
+                        break;
+                    }
+
+                    skip = (at < offset) ? (offset - at) : 0;
+                    n = MIN(dataLen - skip, length - got);
+                    rr = data(&pk->data[8 + skip], n, at + skip, ctx);
+                    if(rr != 0)
+                    {
+                        result = rr;
+                        send_cancel(p->fd);
+                        state = ABORT;
+                        break;
+                    }
+
+                    got += n;
+                    update = (update + 1) % PROGRESS_PACKETS;
+                    if((progress != NULL) && (update == 0))
+                    {
+                        progress(got, length, ctx);
+                    }
+
+                    if((got == length) && !toEnd)
+                    {
+                        result = 0;
+                        send_cancel(p->fd);
+                        state = ABORT;
+                    }
+                }
+                break;
+
+            case DATA_HDD_FILE_END:
+                send_success(p->fd);
+                if(state == DATA)
+                {
+                    result = 0;
+                }
+                goto out;
+                break;
+
+            case FAIL:
+                if(state != ABORT)
+                {
+                    result = device_error(p, pk);
+                    send_cancel(p->fd);
+                    state = ABORT;
+                }
+                break;
+
+            case SUCCESS:
+                goto out;
+                break;
+
+            default:
+                unexpected(p, pk);
+        }
+    }
+
+  out:
+    usb_read_queue_stop(p->fd);
+    if((result == 0) && (progress != NULL))
+    {
+        progress(got, length, ctx);
+    }
+    return leave(p, result);
+}
+
+/* Fill in the file data packet that starts at offset and prepare it for
+ * sending. Returns the number of payload bytes, or a negative errno. */
+static ssize_t stage_packet(struct puppy *p, puppy_source_fn source,
+                            void *ctx, __u64 size, __u64 offset)
+{
+    ssize_t w = sizeof(p->packet.data) - 9;
+    int r;
+
+    if((__u64) w > size - offset)
+    {
+        w = size - offset;
+    }
+
+    /* Packets that are a multiple of 512 bytes upset the Toppy */
+    if((w > 4) && (((((PACKET_HEAD_SIZE + 8 + w) + 1) & ~1) % 0x200) == 0))
+    {
+        w -= 4;
+    }
+
+    r = source(&p->packet.data[8], w, offset, ctx);
+    if(r != 0)
+    {
+        return r;
+    }
+
+    put_u16(&p->packet.length, PACKET_HEAD_SIZE + 8 + w);
+    put_u32(&p->packet.cmd, DATA_HDD_FILE_DATA);
+    put_u64(p->packet.data, offset);
+    prepare_tf_packet(&p->packet);
+    return w;
+}
+
+/* Put size bytes, read through source, into the file at path. Each packet
+ * is staged while the device deals with the one before. */
+int puppy_put(struct puppy *p, const char *path, __u64 size, time_t mtime,
+              puppy_source_fn source, puppy_progress_fn progress,
+              void *ctx)
+{
+    int result = -EPROTO;
+    int update = 0;
+    __u64 done = 0;
+    ssize_t staged = 0;
+    enum
+    {
+        START,
+        DATA,
+        END,
+        FINISHED
+    } state;
+
+    /* The Toppy does not take empty files */
+    if(size == 0)
+    {
+        return -ENODATA;
+    }
+
+    enter(p);
+    if(send_cmd_hdd_file_send(p->fd, PUT, path) < 0)
+    {
+        return leave(p, -EPROTO);
+    }
+
+    state = START;
+    while(0 < get_tf_packet(p->fd, &p->reply))
+    {
+        switch (get_u32(&p->reply.cmd))
+        {
+            case SUCCESS:
+                switch (state)
+                {
+                    case START:
+                    {
+                        struct typefile *tf =
+                            (struct typefile *) p->packet.data;
+
+                        put_u16(&p->packet.length, PACKET_HEAD_SIZE + 114);
+                        put_u32(&p->packet.cmd, DATA_HDD_FILE_START);
+                        time_to_tfdt(mtime, &tf->stamp);
+                        tf->filetype = 2;
+                        put_u64(&tf->size, size);
+                        strncpy((char *) tf->name, path, 94);
+                        tf->name[94] = '\0';
+                        tf->unused = 0;
+                        tf->attrib = 0;
+                        if(send_tf_packet(p->fd, &p->packet) < 0)
+                        {
+                            goto out;
+                        }
+
+                        staged = stage_packet(p, source, ctx, size, done);
+                        if(staged < 0)
+                        {
+                            result = staged;
+                            goto cancel;
+                        }
+                        state = DATA;
+                        break;
+                    }
+
+                    case DATA:
+                        if(send_prepared_tf_packet(p->fd, &p->packet) <
+                           staged)
+                        {
+                            goto out;
+                        }
+                        done += staged;
+
+                        if(done >= size)
+                        {
+                            state = END;
+                        }
+                        else
+                        {
+                            staged = stage_packet(p, source, ctx, size, done);
+                            if(staged < 0)
+                            {
+                                result = staged;
+                                goto cancel;
+                            }
+                        }
+
+                        update = (update + 1) % PROGRESS_PACKETS;
+                        if((progress != NULL) && (update == 0))
+                        {
+                            progress(done, size, ctx);
+                        }
+                        break;
+
+                    case END:
+                        put_u16(&p->packet.length, PACKET_HEAD_SIZE);
+                        put_u32(&p->packet.cmd, DATA_HDD_FILE_END);
+                        if(send_tf_packet(p->fd, &p->packet) < 0)
+                        {
+                            goto out;
+                        }
+                        state = FINISHED;
+                        break;
+
+                    case FINISHED:
+                        result = 0;
+                        if(progress != NULL)
+                        {
+                            progress(done, size, ctx);
+                        }
+                        goto out;
+                        break;
+                }
+                break;
+
+            case FAIL:
+                result = device_error(p, &p->reply);
+                goto out;
+                break;
+
+            default:
+                unexpected(p, &p->reply);
+                break;
+        }
+    }
+    goto out;
+
+  cancel:
+    /* The source failed, so stop the device waiting for more */
+    send_cancel(p->fd);
+    get_tf_packet(p->fd, &p->reply);
+
+  out:
+    return leave(p, result);
+}
+
+int puppy_delete(struct puppy *p, const char *path)
+{
+    enter(p);
+    return leave(p, simple_request(p, send_cmd_hdd_del(p->fd, path)));
+}
+
+int puppy_rename(struct puppy *p, const char *srcPath, const char *dstPath)
+{
+    enter(p);
+    return leave(p, simple_request(p, send_cmd_hdd_rename(p->fd, srcPath,
+                                                          dstPath)));
+}
+
+int puppy_mkdir(struct puppy *p, const char *path)
+{
+    enter(p);
+    return leave(p, simple_request(p, send_cmd_hdd_create_dir(p->fd, path)));
+}
+
+int puppy_turbo(struct puppy *p, int on)
+{
+    enter(p);
+    return leave(p, simple_request(p, send_cmd_turbo(p->fd, on)));
+}
+
+int puppy_cancel(struct puppy *p)
+{
+    enter(p);
+    return leave(p, simple_request(p, send_cancel(p->fd)));
+}
+
+int puppy_reboot(struct puppy *p)
+{
+    enter(p);
+    return leave(p, simple_request(p, send_cmd_reset(p->fd)));
+}
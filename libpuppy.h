@@ -0,0 +1,110 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _LIBPUPPY_H
+#define _LIBPUPPY_H 1
+
+#include <stddef.h>
+#include <time.h>
+#include <asm/types.h>
+
+/* libpuppy lets other programs talk to a Topfield PVR without running
+ * puppy and parsing its output.
+ *
+ * Each open device is a struct puppy handle, which holds all of the
+ * protocol state for that device. Calls on one handle are serialised by a
+ * lock, so a handle may be shared between threads, and separate handles
+ * may be used from separate threads at the same time. CRC checking and
+ * packet tracing are set per handle. The library does not print anything
+ * unless packet tracing is turned on; results come back through the return
+ * value, which is 0 or a negative errno, and through callbacks. When the
+ * device itself refuses a request, the call returns -EPROTO. A packet that
+ * fails its CRC gives -EBADMSG, and its data is never handed over. In
+ * either case, and for transport errors, puppy_error() says why.
+ */
+
+struct puppy;
+
+#define PUPPY_DIR 1
+#define PUPPY_FILE 2
+
+/* Get a range that runs to the end of the file */
+#define PUPPY_TO_END (~0ULL)
+
+struct puppy_entry
+{
+    const char *name;
+    int type;                   /* PUPPY_DIR or PUPPY_FILE */
+    __u64 size;
+    time_t mtime;
+    __u32 attrib;
+};
+
+/* Called for each entry of a directory. A non-zero return is passed back
+   once the listing is complete. */
+typedef int (*puppy_entry_fn) (const struct puppy_entry *entry, void *ctx);
+
+/* Called with each piece of file data, in order. A non-zero return cancels
+   the transfer and is passed back. */
+typedef int (*puppy_data_fn) (const void *data, size_t len, __u64 offset,
+                              void *ctx);
+
+/* Called to fill buf with exactly len bytes of file data from offset.
+   Returns 0, or a negative errno to cancel the transfer. */
+typedef int (*puppy_source_fn) (void *buf, size_t len, __u64 offset,
+                                void *ctx);
+
+/* Called now and then during a transfer */
+typedef void (*puppy_progress_fn) (__u64 done, __u64 total, void *ctx);
+
+/* devPath is a usbfs device node, or unix:<socket> for puppy-emu */
+int puppy_open(const char *devPath, struct puppy **handle);
+int puppy_attach(int fd, struct puppy **handle);
+void puppy_close(struct puppy *p);
+const char *puppy_error(struct puppy *p);
+
+/* Accept packets that fail their CRC, as the USB accelerator patch needs.
+   Off by default. */
+void puppy_ignore_crc(struct puppy *p, int ignore);
+
+/* Dump packet headers (1) or whole packets (2) to stderr. Off by default. */
+void puppy_trace_packets(struct puppy *p, int level);
+
+int puppy_size(struct puppy *p, __u64 *totalBytes, __u64 *freeBytes);
+int puppy_dir(struct puppy *p, const char *path, puppy_entry_fn entry,
+              void *ctx);
+int puppy_get(struct puppy *p, const char *path, __u64 offset,
+              __u64 length, puppy_data_fn data, puppy_progress_fn progress,
+              void *ctx);
+int puppy_put(struct puppy *p, const char *path, __u64 size, time_t mtime,
+              puppy_source_fn source, puppy_progress_fn progress,
+              void *ctx);
+int puppy_delete(struct puppy *p, const char *path);
+int puppy_rename(struct puppy *p, const char *srcPath, const char *dstPath);
+int puppy_mkdir(struct puppy *p, const char *path);
+int puppy_turbo(struct puppy *p, int on);
+int puppy_cancel(struct puppy *p);
+int puppy_reboot(struct puppy *p);
+
+#endif /* _LIBPUPPY_H */
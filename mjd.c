@@ -68,7 +68,8 @@ time_t tfdt_to_time(const struct tf_datetime * dt)
 void time_to_tfdt(const time_t t, struct tf_datetime *dt)
 {
     int y, m, d, k, mjd;
-    struct tm *tm = localtime(&t);
+    struct tm tmBuf;
+    struct tm *tm = localtime_r(&t, &tmBuf);
 
     y = tm->tm_year;
     m = tm->tm_mon + 1;
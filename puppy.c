@@ -30,9 +30,12 @@
 
 #define PUPPY_RELEASE "1.14"
 
+#define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 
 #include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,43 +45,141 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <asm/byteorder.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "usb_io.h"
 #include "tf_bytes.h"
+#include "byte_swap.h"
+#include "crc16.h"
+#include "ingest.h"
+#include "session.h"
+#include "batch.h"
+#include "sync_index.h"
+#include "archive.h"
+#include "transport.h"
 
 #define PUT 0
 #define GET 1
 
+/* Commands made up of several protocol transactions, outside the range
+   used by the protocol itself */
+#define CMD_SYNC (0x10000L)
+
+/* Index file kept in the local directory by sync, unless one is given */
+#define SYNC_INDEX_NAME ".puppy-index"
+
 #define SYSPATH_MAX 256
+#define MAX_TOPPIES 32
 #define TOPPYVID 0x11db
 #define TOPPYPID 0x1000
 
+/* How much of a partial file to compare with the source when resuming */
+#define RESUME_VERIFY 0x10000
+
+/* Seconds between size polls of a file being followed */
+#define FOLLOW_INTERVAL 10
+
+/* Range length for the whole rest of a file */
+#define RANGE_TO_END (~0ULL)
+
+/* Seconds between throughput reports while driving several devices */
+#define ALL_REPORT_INTERVAL 5
+
 extern time_t timezone;
 
 int lockFd = -1;
 int quiet = 0;
+int crcWorker = 0;
+int crcStrict = 0;
+int directIo = 0;
+int preallocate = 0;
+int resume = 0;
+int follow = 0;
 char *devPath = NULL;
+char *listenPath = NULL;
+char *sessionPath = NULL;
+int sessionFd = -1;
+char *cmdName = NULL;
+char *batchPath = NULL;
+int keepGoing = 0;
+int recursive = 0;
+char *archivePath = NULL;
 __u32 cmd = 0;
 char *arg1 = NULL;
 char *arg2 = NULL;
+char *arg3 = NULL;
 __u8 sendDirection = GET;
-struct tf_packet packet;
-struct tf_packet reply;
+int ranged = 0;
+__u64 rangeOffset = 0;
+__u64 rangeLength = RANGE_TO_END;
+int allToppies = 0;
+
+/* Each thread drives its own device, with its own packets */
+__thread struct tf_packet packet;
+__thread struct tf_packet reply;
+
+/* A Topfield device found on the bus */
+struct toppy
+{
+    char name[SYSPATH_MAX];     /* sysfs bus-port, such as 1-1.2 */
+    char path[32];              /* /dev/bus/usb/BBB/DDD */
+};
+
+/* A device driven by a thread of its own, for -a */
+struct device_run
+{
+    struct toppy dev;
+    char *dstPath;              /* this device's local destination */
+    char *indexPath;
+    pthread_t thread;
+    int started;
+    int running;
+    int result;
+    __u64 done;                 /* bytes in finished transfers */
+    __u64 current;              /* bytes so far in the transfer under way */
+    time_t startTime;
+    time_t endTime;
+};
+
+/* Guards the progress of every device_run, and signals a finished one */
+pthread_mutex_t runLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t runCond = PTHREAD_COND_INITIALIZER;
+__thread struct device_run *thisDevice = NULL;
+
+/* Called for each entry of a directory listing, as it arrives */
+typedef int (*dir_entry_handler) (struct typefile *entry, void *ctx);
+
+/* Called with each piece of file data within a requested range */
+typedef int (*range_handler) (const __u8 *data, int len, void *ctx);
 
 int parseArgs(int argc, char *argv[]);
+int parseCommand(char *name, int argc, char *argv[]);
 int isToppy(struct usb_device_descriptor *desc);
+int scanToppies(struct toppy *found, int max);
 char *findToppy(void);
 int do_cancel(int fd);
 int do_cmd_ready(int fd);
 int do_cmd_reset(int fd);
 int do_hdd_size(int fd);
 int do_hdd_dir(int fd, char *path);
+int hdd_dir_each(int fd, char *path, dir_entry_handler handler, void *ctx);
+int hdd_file_size(int fd, char *path, __u64 *size);
+int hdd_file_stat(int fd, char *path, __u64 *size,
+                  struct tf_datetime *stamp);
+int do_hdd_get_recursive(int fd, char *srcPath, char *dstPath);
+int do_hdd_put_recursive(int fd, char *srcPath, char *dstPath);
+int do_hdd_sync(int fd, char *srcPath, char *dstPath, char *indexPath);
 int do_hdd_file_put(int fd, char *srcPath, char *dstPath);
 int do_hdd_file_get(int fd, char *srcPath, char *dstPath);
+int hdd_file_read_range(int fd, char *path, __u64 offset, __u8 *buf,
+                        int len, __u64 *size);
+int do_hdd_file_get_range(int fd, char *srcPath, char *dstPath,
+                          __u64 offset, __u64 length);
 void decode_dir(struct tf_packet *p);
 int do_hdd_del(int fd, char *path);
 int do_hdd_rename(int fd, char *srcPath, char *dstPath);
@@ -97,9 +198,19 @@ void finalStats(__u64 bytes, time_t startTime);
 #define E_GLOBAL_LOCK 8
 #define E_RESET_DEVICE 9
 
+int openToppy(char *path);
+void closeToppy(int fd);
+int runAll(void);
+int runCommand(int fd);
+int runCommandWith(int fd, char *a1, char *a2, char *a3);
+int runRequest(int fd);
+int runBatchLine(int fd, int argc, char *argv[]);
+void resetArgs(void);
+int serveRequest(int argc, char *argv[]);
+
 int main(int argc, char *argv[])
 {
-    struct usb_device_descriptor devDesc;
+    const char *engine;
     int fd = -1;
     int r;
 
@@ -120,6 +231,33 @@ int main(int argc, char *argv[])
         return E_INVALID_ARGS;
     }
 
+    /* A thin client leaves all of the work to the session daemon. */
+    if(sessionPath != NULL)
+    {
+        return session_request(sessionPath, argc, argv);
+    }
+
+    engine = byte_swap_init();
+    trace(1, fprintf(stderr, "Byte swap: %s\n", engine));
+    engine = crc16_init();
+    trace(1, fprintf(stderr, "CRC engine: %s\n", engine));
+
+    if(allToppies)
+    {
+        return runAll();
+    }
+
+    /* Search for a Toppy if the device is not specified */
+    if(devPath == NULL)
+    {
+        devPath = findToppy();
+    }
+
+    if(devPath == NULL)
+    {
+        return E_INVALID_ARGS;
+    }
+
     /* Create a lock, so that other instances of puppy can detect this one. */
     if(0 != flock(lockFd, LOCK_SH | LOCK_NB))
     {
@@ -131,33 +269,76 @@ int main(int argc, char *argv[])
 
     trace(2, fprintf(stderr, "cmd %04x on %s\n", cmd, devPath));
 
-    fd = open(devPath, O_RDWR);
+    fd = openToppy(devPath);
+    if(fd < 0)
+    {
+        return -fd;
+    }
+
+    if(listenPath != NULL)
+    {
+        sessionFd = fd;
+        r = session_serve(listenPath, serveRequest);
+    }
+    else
+    {
+        r = runRequest(fd);
+    }
+
+    closeToppy(fd);
+    return r;
+}
+
+/* Open, reset and claim the Toppy at path. Returns the file descriptor,
+ * or the negated E_ exit code on failure. */
+int openToppy(char *path)
+{
+    struct usb_device_descriptor devDesc;
+    int fd = -1;
+    int r;
+
+    /* An emulated Toppy needs no reset or claiming */
+    if(transport_is_path(path))
+    {
+        fd = transport_connect(path);
+        if(fd < 0)
+        {
+            fprintf(stderr, "ERROR: Can not connect to %s: %s\n", path,
+                    strerror(-fd));
+            return -E_READ_DEVICE;
+        }
+
+        usb_probe_capabilities(fd);
+        return fd;
+    }
+
+    fd = open(path, O_RDWR);
     if(fd < 0)
     {
         fprintf(stderr, "ERROR: Can not open %s for read/write: %s\n",
-                devPath, strerror(errno));
-        return E_READ_DEVICE;
+                path, strerror(errno));
+        return -E_READ_DEVICE;
     }
 
     if(0 != flock(fd, LOCK_EX | LOCK_NB))
     {
-        fprintf(stderr, "ERROR: Can not get exclusive lock on %s\n", devPath);
+        fprintf(stderr, "ERROR: Can not get exclusive lock on %s\n", path);
         close(fd);
-        return E_DEVICE_LOCK;
+        return -E_DEVICE_LOCK;
     }
 
     r = read_device_descriptor(fd, &devDesc);
     if(r < 0)
     {
         close(fd);
-        return E_READ_DEVICE;
+        return -E_READ_DEVICE;
     }
 
     if(!isToppy(&devDesc))
     {
         fprintf(stderr, "ERROR: Could not find a Topfield TF5000PVRt\n");
         close(fd);
-        return E_NOT_TF5000PVR;
+        return -E_NOT_TF5000PVR;
     }
 
     trace(1, fprintf(stderr, "Found a Topfield TF5000PVRt\n"));
@@ -168,7 +349,7 @@ int main(int argc, char *argv[])
     {
         fprintf(stderr, "ERROR: Can not reset device: %s\n", strerror(errno));
         close(fd);
-        return E_RESET_DEVICE;
+        return -E_RESET_DEVICE;
     }
 
     {
@@ -181,7 +362,7 @@ int main(int argc, char *argv[])
             fprintf(stderr, "ERROR: Can not claim interface 0: %s\n",
                     strerror(errno));
             close(fd);
-            return E_CLAIM_INTERFACE;
+            return -E_CLAIM_INTERFACE;
         }
     }
 
@@ -195,10 +376,40 @@ int main(int argc, char *argv[])
             fprintf(stderr, "ERROR: Can not set interface zero: %s\n",
                     strerror(errno));
             close(fd);
-            return E_SET_INTERFACE;
+            return -E_SET_INTERFACE;
         }
     }
 
+    usb_probe_capabilities(fd);
+    return fd;
+}
+
+void closeToppy(int fd)
+{
+    int interface = 0;
+
+    if(transport_get(fd) != NULL)
+    {
+        transport_detach(fd);
+    }
+    else
+    {
+        ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface);
+    }
+    close(fd);
+}
+
+/* Run the command that parseArgs picked out. */
+int runCommand(int fd)
+{
+    return runCommandWith(fd, arg1, arg2, arg3);
+}
+
+/* Run the command that parseArgs picked out, with its arguments replaced. */
+int runCommandWith(int fd, char *a1, char *a2, char *a3)
+{
+    int r;
+
     switch (cmd)
     {
         case CANCEL:
@@ -214,47 +425,169 @@ int main(int argc, char *argv[])
             break;
 
         case CMD_HDD_DIR:
-            r = do_hdd_dir(fd, arg1);
+            r = do_hdd_dir(fd, a1);
             break;
 
         case CMD_HDD_FILE_SEND:
-            if(sendDirection == PUT)
+            if((sendDirection == PUT) && recursive)
+            {
+                r = do_hdd_put_recursive(fd, a1, a2);
+            }
+            else if(sendDirection == PUT)
+            {
+                r = do_hdd_file_put(fd, a1, a2);
+            }
+            else if(recursive)
+            {
+                r = do_hdd_get_recursive(fd, a1, a2);
+            }
+            else if(ranged)
             {
-                r = do_hdd_file_put(fd, arg1, arg2);
+                r = do_hdd_file_get_range(fd, a1, a2, rangeOffset,
+                                          rangeLength);
             }
             else
             {
-                r = do_hdd_file_get(fd, arg1, arg2);
+                r = do_hdd_file_get(fd, a1, a2);
             }
             break;
 
         case CMD_HDD_DEL:
-            r = do_hdd_del(fd, arg1);
+            r = do_hdd_del(fd, a1);
             break;
 
         case CMD_HDD_RENAME:
-            r = do_hdd_rename(fd, arg1, arg2);
+            r = do_hdd_rename(fd, a1, a2);
             break;
 
         case CMD_HDD_CREATE_DIR:
-            r = do_hdd_mkdir(fd, arg1);
+            r = do_hdd_mkdir(fd, a1);
             break;
 
         case CMD_TURBO:
-            r = do_cmd_turbo(fd, arg1);
+            r = do_cmd_turbo(fd, a1);
+            break;
+
+        case CMD_SYNC:
+            r = do_hdd_sync(fd, a1, a2, a3);
             break;
 
         default:
             fprintf(stderr, "BUG: Command 0x%08x not implemented\n", cmd);
             r = -EINVAL;
     }
+    return r;
+}
+
+/* Run either the single command or the batch file given on the command
+ * line. */
+int runRequest(int fd)
+{
+    FILE *in;
+    int r;
 
+    if(batchPath == NULL)
     {
-        int interface = 0;
+        return runCommand(fd);
+    }
 
-        ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface);
-        close(fd);
+    if(0 == strcmp(batchPath, "-"))
+    {
+        return batch_run(stdin, "stdin", keepGoing, fd, runBatchLine);
+    }
+
+    in = fopen(batchPath, "r");
+    if(in == NULL)
+    {
+        fprintf(stderr, "ERROR: Can not open batch file %s: %s\n",
+                batchPath, strerror(errno));
+        return -errno;
+    }
+
+    r = batch_run(in, batchPath, keepGoing, fd, runBatchLine);
+    fclose(in);
+    return r;
+}
+
+/* Run one line of a batch file. The options from the command line apply
+ * to every line. */
+int runBatchLine(int fd, int argc, char *argv[])
+{
+    int myRecursive = recursive;
+    int r;
+
+    if(0 != parseCommand(argv[0], argc - 1, &argv[1]))
+    {
+        r = -EINVAL;
+    }
+    else
+    {
+        r = runCommand(fd);
+    }
+
+    recursive = myRecursive;
+    return r;
+}
+
+/* Put the per-command settings back to their defaults. */
+void resetArgs(void)
+{
+    ignore_crc = 0;
+    preallocate = 0;
+    crcWorker = 0;
+    crcStrict = 0;
+    directIo = 0;
+    resume = 0;
+    follow = 0;
+    verbose = 0;
+    packet_trace = 0;
+    quiet = 0;
+    cmd = 0;
+    sendDirection = GET;
+    ranged = 0;
+    rangeOffset = 0;
+    rangeLength = RANGE_TO_END;
+    arg1 = NULL;
+    arg2 = NULL;
+    arg3 = NULL;
+    cmdName = NULL;
+    batchPath = NULL;
+    keepGoing = 0;
+    recursive = 0;
+    archivePath = NULL;
+    allToppies = 0;
+}
+
+/* Run one command line for a session client, on the device that the session
+ * holds open. Options apply to this command only. */
+int serveRequest(int argc, char *argv[])
+{
+    char *myDevPath = devPath;
+    char *myListenPath = listenPath;
+    int myVerbose = verbose;
+    int r;
+
+    resetArgs();
+    optind = 0;
+    r = parseArgs(argc, argv);
+    if((r == 0) && (listenPath != myListenPath))
+    {
+        fprintf(stderr, "ERROR: Can not start a session from a session.\n");
+        r = -1;
+    }
+    if(r != 0)
+    {
+        r = -EINVAL;
+    }
+    else
+    {
+        r = runRequest(sessionFd);
     }
+
+    devPath = myDevPath;
+    listenPath = myListenPath;
+    sessionPath = NULL;
+    verbose = myVerbose;
     return r;
 }
 
@@ -483,107 +816,1019 @@ int do_hdd_dir(int fd, char *path)
     return -EPROTO;
 }
 
-void decode_dir(struct tf_packet *p)
+/* List a directory on the device, handing each entry to handler as its
+ * packet arrives. The whole listing is always read, but the first non-zero
+ * handler result is returned. Returns -ENOENT if the device refuses to list
+ * the directory.
+ */
+int hdd_dir_each(int fd, char *path, dir_entry_handler handler, void *ctx)
 {
-    __u16 count =
-        (get_u16(&p->length) - PACKET_HEAD_SIZE) / sizeof(struct typefile);
-    struct typefile *entries = (struct typefile *) p->data;
-    int i;
-    time_t timestamp;
+    int result = 0;
 
-    for(i = 0; (i < count); i++)
+    if(0 > send_cmd_hdd_dir(fd, path))
     {
-        char type;
+        return -EPROTO;
+    }
 
-        switch (entries[i].filetype)
+    while(0 < get_tf_packet(fd, &reply))
+    {
+        switch (get_u32(&reply.cmd))
         {
-            case 1:
-                type = 'd';
+            case DATA_HDD_DIR:
+            {
+                __u16 count = (get_u16(&reply.length) - PACKET_HEAD_SIZE) /
+                    sizeof(struct typefile);
+                struct typefile *entries = (struct typefile *) reply.data;
+                int i;
+
+                for(i = 0; i < count; i++)
+                {
+                    int r;
+
+                    /* The name need not be terminated */
+                    entries[i].unused = 0;
+                    r = handler(&entries[i], ctx);
+                    if(result == 0)
+                    {
+                        result = r;
+                    }
+                }
+                send_success(fd);
+                break;
+            }
+
+            case DATA_HDD_DIR_END:
+                return result;
                 break;
 
-            case 2:
-                type = 'f';
+            case FAIL:
+                trace(1, fprintf(stderr, "Can not list %s: %s\n", path,
+                                 decode_error(&reply)));
+                return -ENOENT;
                 break;
 
             default:
-                type = '?';
+                fprintf(stderr, "ERROR: Unhandled packet\n");
+                return -EPROTO;
         }
-
-        /* This makes the assumption that the timezone of the Toppy and the system
-         * that puppy runs on are the same. Given the limitations on the length of
-         * USB cables, this condition is likely to be satisfied. */
-        timestamp = tfdt_to_time(&entries[i].stamp);
-        printf("%c %20llu %24.24s %s\n", type, get_u64(&entries[i].size),
-               ctime(&timestamp), entries[i].name);
     }
+    return -EPROTO;
 }
 
-int do_hdd_file_put(int fd, char *srcPath, char *dstPath)
+struct file_size_lookup
 {
-    int result = -EPROTO;
-    time_t startTime = time(NULL);
-    enum
+    char *name;
+    __u64 size;
+    struct tf_datetime stamp;
+    int found;
+};
+
+static int file_size_entry(struct typefile *entry, void *ctx)
+{
+    struct file_size_lookup *lookup = ctx;
+
+    if((entry->filetype == 2) &&
+       (0 == strcmp((char *) entry->name, lookup->name)))
     {
-        START,
-        DATA,
-        END,
-        FINISHED
-    } state;
-    int src = -1;
+        lookup->size = get_u64(&entry->size);
+        lookup->stamp = entry->stamp;
+        lookup->found = 1;
+    }
+    return 0;
+}
+
+/* Look up the size of a file on the device by listing its parent directory.
+ * Returns 0 and fills in size if the file exists, -ENOENT if it does not.
+ */
+int hdd_file_size(int fd, char *path, __u64 *size)
+{
+    return hdd_file_stat(fd, path, size, NULL);
+}
+
+/* As hdd_file_size, but also fill in the modification stamp if stamp is
+ * not NULL. */
+int hdd_file_stat(int fd, char *path, __u64 *size, struct tf_datetime *stamp)
+{
+    struct file_size_lookup lookup;
+    char *parent = strdup(path);
+    char *sep;
+    char *dirPath = "\\";
     int r;
-    int update = 0;
-    struct stat64 srcStat;
-    __u64 fileSize;
-    __u64 byteCount = 0;
 
-    trace(4, fprintf(stderr, "%s\n", __func__));
+    memset(&lookup, 0, sizeof(lookup));
+    lookup.name = path;
+    if(parent == NULL)
+    {
+        return -ENOMEM;
+    }
 
-    src = open64(srcPath, O_RDONLY);
-    if(src < 0)
+    sep = strrchr(parent, '\\');
+    if(sep != NULL)
     {
-        fprintf(stderr, "ERROR: Can not open source file: %s\n",
-                strerror(errno));
-        return errno;
+        *sep = '\0';
+        lookup.name = sep + 1;
+        if(sep != parent)
+        {
+            dirPath = parent;
+        }
     }
 
-    if(0 != fstat64(src, &srcStat))
+    r = hdd_dir_each(fd, dirPath, file_size_entry, &lookup);
+    free(parent);
+    if(r != 0)
     {
-        fprintf(stderr, "ERROR: Can not examine source file: %s\n",
-                strerror(errno));
-        result = errno;
-        goto out;
+        return r;
+    }
+    if(!lookup.found)
+    {
+        return -ENOENT;
     }
 
-    fileSize = srcStat.st_size;
-    if(fileSize == 0)
+    *size = lookup.size;
+    if(stamp != NULL)
     {
-        fprintf(stderr, "ERROR: Source file is empty - not transfering.\n");
-        result = -ENODATA;
-        goto out;
+        *stamp = lookup.stamp;
     }
+    return 0;
+}
 
-    r = send_cmd_hdd_file_send(fd, PUT, dstPath);
-    if(r < 0)
+/* Join a directory and a name with sep, in freshly allocated memory. */
+static char *join_path(const char *dir, char sep, const char *name)
+{
+    size_t len = strlen(dir);
+    char *path = malloc(len + strlen(name) + 2);
+
+    if(path != NULL)
     {
-        goto out;
+        strcpy(path, dir);
+        if((len == 0) || (dir[len - 1] != sep))
+        {
+            path[len++] = sep;
+        }
+        strcpy(&path[len], name);
+    }
+    return path;
+}
+
+/* One step of a recursive transfer: a file to copy or a directory to visit */
+struct xfer
+{
+    struct xfer *next;
+    char *remote;
+    char *local;
+    __u64 size;
+    __u64 stamp;                /* remote timestamp, as a sync index key */
+    int created;                /* directory made by this transfer */
+};
+
+struct xfer_queue
+{
+    struct xfer *head;
+    struct xfer **tail;
+};
+
+/* Queue the entry called name in a pair of directories, or the directories
+ * themselves if name is NULL. A '/' in name, which the Toppy allows, is
+ * replaced locally with '_' so that it can not reach outside localDir.
+ * Returns the new entry, or NULL if out of memory. */
+static struct xfer *xfer_add(struct xfer_queue *q, const char *remoteDir,
+                             const char *localDir, const char *name,
+                             __u64 size)
+{
+    struct xfer *x = malloc(sizeof(*x));
+
+    if(x == NULL)
+    {
+        return NULL;
     }
 
-    state = START;
-    while(0 < get_tf_packet(fd, &reply))
+    x->next = NULL;
+    if(name == NULL)
     {
-        update = (update + 1) % 16;
-        switch (get_u32(&reply.cmd))
+        x->remote = strdup(remoteDir);
+        x->local = strdup(localDir);
+    }
+    else
+    {
+        x->remote = join_path(remoteDir, '\\', name);
+        x->local = join_path(localDir, '/', name);
+        if(x->local != NULL)
         {
-            case SUCCESS:
-                switch (state)
+            char *c;
+
+            for(c = x->local + strlen(x->local) - strlen(name); *c; c++)
+            {
+                if(*c == '/')
                 {
-                    case START:
-                    {
-                        /* Send start */
-                        struct typefile *tf = (struct typefile *) packet.data;
+                    *c = '_';
+                }
+            }
+        }
+    }
+    x->size = size;
+    x->stamp = 0;
+    x->created = 0;
+    if((x->remote == NULL) || (x->local == NULL))
+    {
+        free(x->remote);
+        free(x->local);
+        free(x);
+        return NULL;
+    }
 
-                        put_u16(&packet.length, PACKET_HEAD_SIZE + 114);
-                        put_u32(&packet.cmd, DATA_HDD_FILE_START);
+    *q->tail = x;
+    q->tail = &x->next;
+    return x;
+}
+
+static struct xfer *xfer_take(struct xfer_queue *q)
+{
+    struct xfer *x = q->head;
+
+    if(x != NULL)
+    {
+        q->head = x->next;
+        if(q->head == NULL)
+        {
+            q->tail = &q->head;
+        }
+    }
+    return x;
+}
+
+static void xfer_free(struct xfer *x)
+{
+    free(x->remote);
+    free(x->local);
+    free(x);
+}
+
+struct mirror
+{
+    struct xfer_queue dirs;     /* directories still to visit */
+    struct xfer_queue files;    /* files found in the current directory */
+    struct xfer *current;       /* the directory being listed */
+    struct sync_index *index;   /* files already archived, for sync */
+    int skipped;
+};
+
+static __u64 tfdt_key(const struct tf_datetime *dt)
+{
+    return ((__u64) get_u16(&dt->mjd) << 24) | (dt->hour << 16) |
+        (dt->minute << 8) | dt->second;
+}
+
+/* Queue up each entry of a remote directory as it arrives. Subdirectories
+ * are created locally straight away and visited later. */
+static int mirror_entry(struct typefile *entry, void *ctx)
+{
+    struct mirror *m = ctx;
+    char *name = (char *) entry->name;
+    struct xfer *x;
+
+    if((0 == strcmp(name, ".")) || (0 == strcmp(name, "..")) ||
+       (name[0] == '\0'))
+    {
+        return 0;
+    }
+
+    switch (entry->filetype)
+    {
+        case 1:
+            x = xfer_add(&m->dirs, m->current->remote, m->current->local,
+                         name, 0);
+            break;
+
+        case 2:
+        {
+            __u64 size = get_u64(&entry->size);
+            __u64 stamp = tfdt_key(&entry->stamp);
+
+            /* Leave out anything archived before, unchanged */
+            if(m->index != NULL)
+            {
+                char *remote = join_path(m->current->remote, '\\', name);
+                int known;
+
+                if(remote == NULL)
+                {
+                    return -ENOMEM;
+                }
+                known = sync_index_match(m->index, remote, size, stamp);
+                free(remote);
+                if(known)
+                {
+                    m->skipped++;
+                    return 0;
+                }
+            }
+
+            x = xfer_add(&m->files, m->current->remote, m->current->local,
+                         name, size);
+            if(x != NULL)
+            {
+                x->stamp = stamp;
+            }
+            break;
+        }
+
+        default:
+            return 0;
+    }
+    return (x != NULL) ? 0 : -ENOMEM;
+}
+
+/* Copy a directory tree from the device, one directory at a time. The files
+ * in each directory are fetched as soon as its listing is complete, before
+ * moving on to its subdirectories. With an index, only files that are not
+ * in it already are fetched, and each one is added as it arrives. */
+static int mirror_tree(int fd, char *srcPath, char *dstPath,
+                       struct sync_index *index)
+{
+    struct mirror m;
+    struct xfer *x;
+    time_t startTime = time(NULL);
+    __u64 totalBytes = 0;
+    int files = 0;
+    int failed = 0;
+    int result = 0;
+    int committed = 0;
+    int r;
+
+    m.dirs.head = m.files.head = NULL;
+    m.dirs.tail = &m.dirs.head;
+    m.files.tail = &m.files.head;
+    m.current = NULL;
+    m.index = index;
+    m.skipped = 0;
+
+    /* Seed the walk with the top directory itself */
+    r = (NULL != xfer_add(&m.dirs, srcPath, dstPath, NULL, 0)) ? 0 : -ENOMEM;
+
+    while((r == 0) && (NULL != (m.current = xfer_take(&m.dirs))))
+    {
+        if((0 != mkdir(m.current->local, 0777)) && (errno != EEXIST))
+        {
+            fprintf(stderr, "ERROR: Can not create directory %s: %s\n",
+                    m.current->local, strerror(errno));
+            r = -errno;
+            break;
+        }
+
+        trace(1, fprintf(stderr, "Mirroring %s\n", m.current->remote));
+        r = hdd_dir_each(fd, m.current->remote, mirror_entry, &m);
+        if(r != 0)
+        {
+            fprintf(stderr, "ERROR: Can not list %s\n", m.current->remote);
+            break;
+        }
+
+        while(NULL != (x = xfer_take(&m.files)))
+        {
+            trace(1, fprintf(stderr, "%s -> %s\n", x->remote, x->local));
+            r = do_hdd_file_get(fd, x->remote, x->local);
+            if((r == 0) && (index != NULL))
+            {
+                r = sync_index_add(index, x->remote, x->size, x->stamp);
+            }
+            if(r == 0)
+            {
+                files++;
+                totalBytes += x->size;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Can not get %s\n", x->remote);
+                if(failed++ == 0)
+                {
+                    result = r;
+                }
+            }
+            xfer_free(x);
+            r = 0;
+        }
+
+        /* Record progress a directory at a time, so that an interrupted
+           sync does not fetch everything again. A failed commit keeps its
+           additions for the next, so only the last one decides. */
+        if(index != NULL)
+        {
+            committed = sync_index_commit(index);
+        }
+
+        xfer_free(m.current);
+        m.current = NULL;
+    }
+
+    if(m.current != NULL)
+    {
+        xfer_free(m.current);
+    }
+    while(NULL != (x = xfer_take(&m.dirs)))
+    {
+        xfer_free(x);
+    }
+    while(NULL != (x = xfer_take(&m.files)))
+    {
+        xfer_free(x);
+    }
+
+    if(!quiet)
+    {
+        fprintf(stderr, "\n%d files copied, %d failed", files, failed);
+        if(index != NULL)
+        {
+            fprintf(stderr, ", %d already archived", m.skipped);
+        }
+        fprintf(stderr, "\n");
+    }
+    finalStats(totalBytes, startTime);
+    if(result == 0)
+    {
+        result = committed;
+    }
+    return (r != 0) ? r : result;
+}
+
+int do_hdd_get_recursive(int fd, char *srcPath, char *dstPath)
+{
+    return mirror_tree(fd, srcPath, dstPath, NULL);
+}
+
+/* Bring a local archive of a remote directory tree up to date. The index
+ * records the name, size and timestamp of every file archived so far, so
+ * only new or changed files are fetched. */
+int do_hdd_sync(int fd, char *srcPath, char *dstPath, char *indexPath)
+{
+    struct sync_index index;
+    char *defaultPath = NULL;
+    int r;
+
+    /* The archive directory must exist to hold the index */
+    if((0 != mkdir(dstPath, 0777)) && (errno != EEXIST))
+    {
+        fprintf(stderr, "ERROR: Can not create directory %s: %s\n", dstPath,
+                strerror(errno));
+        return -errno;
+    }
+
+    if(indexPath == NULL)
+    {
+        defaultPath = join_path(dstPath, '/', SYNC_INDEX_NAME);
+        if(defaultPath == NULL)
+        {
+            return -ENOMEM;
+        }
+        indexPath = defaultPath;
+    }
+
+    r = sync_index_open(&index, indexPath);
+    if(r == 0)
+    {
+        r = mirror_tree(fd, srcPath, dstPath, &index);
+        sync_index_close(&index);
+    }
+
+    free(defaultPath);
+    return r;
+}
+
+/* Names of the subdirectories in a remote directory listing */
+struct name_list
+{
+    char **names;
+    int count;
+    int size;
+};
+
+static int collect_dir(struct typefile *entry, void *ctx)
+{
+    struct name_list *l = ctx;
+
+    if(entry->filetype != 1)
+    {
+        return 0;
+    }
+
+    if(l->count == l->size)
+    {
+        int size = l->size ? (l->size * 2) : 16;
+        char **names = realloc(l->names, size * sizeof(*names));
+
+        if(names == NULL)
+        {
+            return -ENOMEM;
+        }
+        l->names = names;
+        l->size = size;
+    }
+
+    l->names[l->count] = strdup((char *) entry->name);
+    if(l->names[l->count] == NULL)
+    {
+        return -ENOMEM;
+    }
+    l->count++;
+    return 0;
+}
+
+static int name_listed(const struct name_list *l, const char *name)
+{
+    int i;
+
+    for(i = 0; i < l->count; i++)
+    {
+        if(0 == strcmp(l->names[i], name))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void name_list_clear(struct name_list *l)
+{
+    while(l->count > 0)
+    {
+        free(l->names[--l->count]);
+    }
+}
+
+/* Copy a local directory tree to the device. Each remote directory is
+ * listed once to see which subdirectories already exist, and only the
+ * missing ones are created. Directories created here are known to be empty
+ * and are not listed at all. */
+int do_hdd_put_recursive(int fd, char *srcPath, char *dstPath)
+{
+    struct xfer_queue dirs;
+    struct xfer_queue files;
+    struct name_list remote = { NULL, 0, 0 };
+    struct xfer *cur;
+    struct xfer *x;
+    time_t startTime = time(NULL);
+    __u64 totalBytes = 0;
+    int count = 0;
+    int failed = 0;
+    int result = 0;
+    int r = 0;
+
+    dirs.head = files.head = NULL;
+    dirs.tail = &dirs.head;
+    files.tail = &files.head;
+
+    if(NULL == xfer_add(&dirs, dstPath, srcPath, NULL, 0))
+    {
+        return -ENOMEM;
+    }
+
+    while((r == 0) && (NULL != (cur = xfer_take(&dirs))))
+    {
+        DIR *dir;
+        struct dirent *de;
+
+        trace(1, fprintf(stderr, "Uploading %s\n", cur->local));
+
+        if(!cur->created)
+        {
+            r = hdd_dir_each(fd, cur->remote, collect_dir, &remote);
+            if(r == -ENOENT)
+            {
+                /* Only the top of the tree can be missing like this */
+                r = do_hdd_mkdir(fd, cur->remote);
+            }
+            if(r != 0)
+            {
+                fprintf(stderr, "ERROR: Can not prepare %s\n", cur->remote);
+                xfer_free(cur);
+                break;
+            }
+        }
+
+        dir = opendir(cur->local);
+        if(dir == NULL)
+        {
+            fprintf(stderr, "ERROR: Can not read directory %s: %s\n",
+                    cur->local, strerror(errno));
+            r = -errno;
+            xfer_free(cur);
+            break;
+        }
+
+        while((r == 0) && (NULL != (de = readdir(dir))))
+        {
+            struct stat64 st;
+            char *local;
+
+            if((0 == strcmp(de->d_name, ".")) ||
+               (0 == strcmp(de->d_name, "..")))
+            {
+                continue;
+            }
+
+            local = join_path(cur->local, '/', de->d_name);
+            if(local == NULL)
+            {
+                r = -ENOMEM;
+                break;
+            }
+
+            if(0 != stat64(local, &st))
+            {
+                fprintf(stderr, "ERROR: Can not examine %s: %s\n", local,
+                        strerror(errno));
+                if(failed++ == 0)
+                {
+                    result = -errno;
+                }
+            }
+            else if(S_ISDIR(st.st_mode))
+            {
+                x = xfer_add(&dirs, cur->remote, cur->local, de->d_name, 0);
+                if(x == NULL)
+                {
+                    r = -ENOMEM;
+                }
+                else if(cur->created || !name_listed(&remote, de->d_name))
+                {
+                    r = do_hdd_mkdir(fd, x->remote);
+                    x->created = 1;
+                }
+            }
+            else if(S_ISREG(st.st_mode) && (st.st_size == 0))
+            {
+                trace(1, fprintf(stderr, "Skipping empty file %s\n", local));
+            }
+            else if(S_ISREG(st.st_mode))
+            {
+                if(NULL == xfer_add(&files, cur->remote, cur->local,
+                                    de->d_name, st.st_size))
+                {
+                    r = -ENOMEM;
+                }
+            }
+            free(local);
+        }
+        closedir(dir);
+        name_list_clear(&remote);
+        xfer_free(cur);
+
+        while((r == 0) && (NULL != (x = xfer_take(&files))))
+        {
+            trace(1, fprintf(stderr, "%s -> %s\n", x->local, x->remote));
+            if(0 == do_hdd_file_put(fd, x->local, x->remote))
+            {
+                count++;
+                totalBytes += x->size;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Can not put %s\n", x->local);
+                if(failed++ == 0)
+                {
+                    result = -EIO;
+                }
+            }
+            xfer_free(x);
+        }
+    }
+
+    while(NULL != (x = xfer_take(&dirs)))
+    {
+        xfer_free(x);
+    }
+    while(NULL != (x = xfer_take(&files)))
+    {
+        xfer_free(x);
+    }
+    name_list_clear(&remote);
+    free(remote.names);
+
+    if(!quiet)
+    {
+        fprintf(stderr, "\n%d files copied, %d failed\n", count, failed);
+    }
+    finalStats(totalBytes, startTime);
+    return (r != 0) ? r : result;
+}
+
+void decode_dir(struct tf_packet *p)
+{
+    __u16 count =
+        (get_u16(&p->length) - PACKET_HEAD_SIZE) / sizeof(struct typefile);
+    struct typefile *entries = (struct typefile *) p->data;
+    int i;
+    time_t timestamp;
+    char when[26];
+
+    for(i = 0; (i < count); i++)
+    {
+        char type;
+
+        switch (entries[i].filetype)
+        {
+            case 1:
+                type = 'd';
+                break;
+
+            case 2:
+                type = 'f';
+                break;
+
+            default:
+                type = '?';
+        }
+
+        /* This makes the assumption that the timezone of the Toppy and the system
+         * that puppy runs on are the same. Given the limitations on the length of
+         * USB cables, this condition is likely to be satisfied. */
+        timestamp = tfdt_to_time(&entries[i].stamp);
+        ctime_r(&timestamp, when);
+
+        /* Under -a the listings of several devices arrive together */
+        printf("%s%s%c %20llu %24.24s %s\n",
+               (thisDevice != NULL) ? thisDevice->dev.name : "",
+               (thisDevice != NULL) ? ": " : "", type,
+               get_u64(&entries[i].size), when, entries[i].name);
+    }
+}
+
+/* Set while a packet is copied out of a mapped source, so that a source
+   truncated by another process fails the put instead of killing puppy */
+static __thread sigjmp_buf *volatile mapFault = NULL;
+static pthread_once_t mapFaultOnce = PTHREAD_ONCE_INIT;
+
+static void map_fault(int sig)
+{
+    if(mapFault != NULL)
+    {
+        siglongjmp(*mapFault, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void map_fault_install(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = map_fault;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/* Fill in the file data packet that starts at offset, from the mapped
+ * source if there is one, and prepare it for sending. Returns the number of
+ * payload bytes, or -1 if the source can not be read.
+ */
+static ssize_t stage_put_packet(int src, const __u8 *map, __u64 fileSize,
+                                __u64 offset, struct tf_packet *p)
+{
+    ssize_t w = sizeof(p->data) - 9;
+    ssize_t got = 0;
+
+    if((__u64) w > fileSize - offset)
+    {
+        w = fileSize - offset;
+    }
+
+    /* Detect a Topfield protocol bug and prevent the sending of packets
+       that are a multiple of 512 bytes. */
+    if((w > 4) && (((((PACKET_HEAD_SIZE + 8 + w) + 1) & ~1) % 0x200) == 0))
+    {
+        w -= 4;
+    }
+
+    if(map != NULL)
+    {
+        struct stat64 st;
+        sigjmp_buf jb;
+
+        /* The mapping outlives any change to the file, so make sure the
+           data is still there before touching it. */
+        if((0 != fstat64(src, &st)) || ((__u64) st.st_size < offset + w))
+        {
+            fprintf(stderr, "ERROR: Source file has shrunk during transfer\n");
+            return -1;
+        }
+        if(0 != sigsetjmp(jb, 1))
+        {
+            mapFault = NULL;
+            fprintf(stderr, "ERROR: Source file has shrunk during transfer\n");
+            return -1;
+        }
+        mapFault = &jb;
+        memcpy(&p->data[8], map + offset, w);
+        mapFault = NULL;
+    }
+    else
+    {
+        while(got < w)
+        {
+            ssize_t n = pread64(src, &p->data[8 + got], w - got,
+                                offset + got);
+
+            if(n <= 0)
+            {
+                if((n < 0) && (errno == EINTR))
+                {
+                    continue;
+                }
+
+                fprintf(stderr, "ERROR: Can not read source file: %s\n",
+                        (n < 0) ? strerror(errno) : "Unexpected end of file");
+                return -1;
+            }
+            got += n;
+        }
+    }
+
+    put_u16(&p->length, PACKET_HEAD_SIZE + 8 + w);
+    put_u32(&p->cmd, DATA_HDD_FILE_DATA);
+    put_u64(p->data, offset);
+    prepare_tf_packet(p);
+    return w;
+}
+
+/* Work out where an interrupted put can carry on from. The partial file on
+ * the device is only trusted if it carries the source's modification stamp,
+ * is no larger than the source, and its last RESUME_VERIFY bytes match the
+ * source. Returns the offset to resume at, which is fileSize if the file
+ * is already complete, or 0 if it all has to be sent.
+ */
+static __u64 put_resume_point(int fd, int src, char *dstPath,
+                              const struct stat64 *srcStat)
+{
+    struct tf_datetime localStamp;
+    struct tf_datetime remoteStamp;
+    __u64 fileSize = srcStat->st_size;
+    __u64 remoteSize = 0;
+    __u64 remoteTotal = 0;
+    __u8 *remote = NULL;
+    __u8 *local = NULL;
+    int len;
+    int r;
+
+    if((0 != hdd_file_stat(fd, dstPath, &remoteSize, &remoteStamp)) ||
+       (remoteSize == 0))
+    {
+        return 0;
+    }
+
+    time_to_tfdt(srcStat->st_mtime, &localStamp);
+    if((remoteSize > fileSize) ||
+       (0 != memcmp(&localStamp, &remoteStamp, sizeof(localStamp))))
+    {
+        trace(1, fprintf(stderr,
+                         "%s on the device is not part of this file, sending it all\n",
+                         dstPath));
+        return 0;
+    }
+
+    len = MIN(remoteSize, RESUME_VERIFY);
+    remote = malloc(len);
+    local = malloc(len);
+    if((remote == NULL) || (local == NULL))
+    {
+        remoteSize = 0;
+        goto out;
+    }
+
+    r = hdd_file_read_range(fd, dstPath, remoteSize - len, remote, len,
+                            &remoteTotal);
+    if((r != len) || (remoteTotal != remoteSize) ||
+       (len != pread64(src, local, len, remoteSize - len)) ||
+       (0 != memcmp(remote, local, len)))
+    {
+        trace(1, fprintf(stderr,
+                         "End of %s on the device does not match, sending it all\n",
+                         dstPath));
+        remoteSize = 0;
+    }
+
+  out:
+    free(remote);
+    free(local);
+    return remoteSize;
+}
+
+int do_hdd_file_put(int fd, char *srcPath, char *dstPath)
+{
+    int result = -EPROTO;
+    time_t startTime = time(NULL);
+    enum
+    {
+        START,
+        DATA,
+        END,
+        FINISHED
+    } state;
+    int src = -1;
+    int r;
+    int update = 0;
+    struct stat64 srcStat;
+    __u64 fileSize;
+    __u64 byteCount = 0;
+    __u64 resumeAt = 0;
+    __u64 remoteSize = 0;
+    __u8 *map = NULL;
+    ssize_t staged = 0;
+
+    trace(4, fprintf(stderr, "%s\n", __func__));
+
+    src = open64(srcPath, O_RDONLY);
+    if(src < 0)
+    {
+        fprintf(stderr, "ERROR: Can not open source file: %s\n",
+                strerror(errno));
+        return errno;
+    }
+
+    if(0 != fstat64(src, &srcStat))
+    {
+        fprintf(stderr, "ERROR: Can not examine source file: %s\n",
+                strerror(errno));
+        result = errno;
+        goto out;
+    }
+
+    fileSize = srcStat.st_size;
+    if(fileSize == 0)
+    {
+        fprintf(stderr, "ERROR: Source file is empty - not transfering.\n");
+        result = -ENODATA;
+        goto out;
+    }
+
+    /* Map the source where possible, so that staging a packet is a copy
+       from the page cache, and let the kernel read ahead. */
+    if(fileSize == (size_t) fileSize)
+    {
+        map = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, src, 0);
+        if(map == MAP_FAILED)
+        {
+            trace(2, fprintf(stderr, "Can not map source file: %s\n",
+                             strerror(errno)));
+            map = NULL;
+        }
+        else
+        {
+            madvise(map, fileSize, MADV_SEQUENTIAL);
+            pthread_once(&mapFaultOnce, map_fault_install);
+        }
+    }
+    if(map == NULL)
+    {
+        posix_fadvise64(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    /* Carry on from the end of whatever part of the file already made it
+       to the device, once it is known to be the start of this file. */
+    if(resume)
+    {
+        resumeAt = put_resume_point(fd, src, dstPath, &srcStat);
+        if(resumeAt == fileSize)
+        {
+            trace(1, fprintf(stderr, "%s is already complete\n", dstPath));
+            result = 0;
+            goto out;
+        }
+    }
+
+  restart:
+    byteCount = resumeAt;
+
+    if(resumeAt > 0)
+    {
+        trace(1, fprintf(stderr, "Resuming %s at offset %llu\n", dstPath,
+                         resumeAt));
+        r = send_cmd_hdd_file_send_with_offset(fd, PUT, dstPath, resumeAt);
+    }
+    else
+    {
+        r = send_cmd_hdd_file_send(fd, PUT, dstPath);
+    }
+    if(r < 0)
+    {
+        goto out;
+    }
+
+    state = START;
+    while(0 < get_tf_packet(fd, &reply))
+    {
+        update = (update + 1) % 16;
+        switch (get_u32(&reply.cmd))
+        {
+            case SUCCESS:
+                switch (state)
+                {
+                    case START:
+                    {
+                        /* Send start */
+                        struct typefile *tf = (struct typefile *) packet.data;
+
+                        put_u16(&packet.length, PACKET_HEAD_SIZE + 114);
+                        put_u32(&packet.cmd, DATA_HDD_FILE_START);
                         time_to_tfdt(srcStat.st_mtime, &tf->stamp);
                         tf->filetype = 2;
                         put_u64(&tf->size, srcStat.st_size);
@@ -600,134 +1845,582 @@ int do_hdd_file_put(int fd, char *srcPath, char *dstPath)
                             fprintf(stderr, "ERROR: Incomplete send.\n");
                             goto out;
                         }
+
+                        /* Have the first data packet ready to go as soon as
+                           the device acknowledges the start. */
+                        staged = stage_put_packet(src, map, fileSize,
+                                                  byteCount, &packet);
+                        if(staged <= 0)
+                        {
+                            goto out;
+                        }
                         state = DATA;
                         break;
                     }
-
-                    case DATA:
+
+                    case DATA:
+                        trace(3,
+                              fprintf(stderr, "%s: DATA_HDD_FILE_DATA\n",
+                                      __func__));
+                        r = send_prepared_tf_packet(fd, &packet);
+                        if(r < staged)
+                        {
+                            fprintf(stderr, "ERROR: Incomplete send.\n");
+                            goto out;
+                        }
+                        byteCount += staged;
+
+                        /* Stage the next packet while the device deals with
+                           this one, or move on to the end. */
+                        if(byteCount >= fileSize)
+                        {
+                            state = END;
+                        }
+                        else
+                        {
+                            staged = stage_put_packet(src, map, fileSize,
+                                                      byteCount, &packet);
+                            if(staged <= 0)
+                            {
+                                goto out;
+                            }
+                        }
+
+                        if(!update && !quiet)
+                        {
+                            progressStats(fileSize, byteCount, startTime);
+                        }
+                        break;
+
+                    case END:
+                        /* Send end */
+                        put_u16(&packet.length, PACKET_HEAD_SIZE);
+                        put_u32(&packet.cmd, DATA_HDD_FILE_END);
+                        trace(3,
+                              fprintf(stderr, "%s: DATA_HDD_FILE_END\n",
+                                      __func__));
+                        r = send_tf_packet(fd, &packet);
+                        if(r < 0)
+                        {
+                            fprintf(stderr, "ERROR: Incomplete send.\n");
+                            goto out;
+                        }
+                        state = FINISHED;
+                        break;
+
+                    case FINISHED:
+                        /* Firmware that ignores the offset leaves a file of
+                           the wrong size, so check and send it all again. */
+                        if((resumeAt > 0) &&
+                           ((0 != hdd_file_size(fd, dstPath, &remoteSize)) ||
+                            (remoteSize != fileSize)))
+                        {
+                            trace(1, fprintf(stderr,
+                                             "Resume failed, sending the whole file\n"));
+                            resumeAt = 0;
+                            goto restart;
+                        }
+                        finalStats(byteCount - resumeAt, startTime);
+                        result = 0;
+                        goto out;
+                        break;
+                }
+                break;
+
+            case FAIL:
+                /* Before any data has gone, a refusal is most likely the
+                   device not taking the offset. */
+                if((resumeAt > 0) && (byteCount == resumeAt))
+                {
+                    trace(1, fprintf(stderr,
+                                     "Device refused to resume (%s), sending the whole file\n",
+                                     decode_error(&reply)));
+                    resumeAt = 0;
+                    goto restart;
+                }
+                fprintf(stderr, "ERROR: Device reports %s\n",
+                        decode_error(&reply));
+                goto out;
+                break;
+
+            default:
+                fprintf(stderr, "ERROR: Unhandled packet\n");
+                break;
+        }
+    }
+    finalStats(byteCount, startTime);
+
+  out:
+    if(map != NULL)
+    {
+        munmap(map, fileSize);
+    }
+    close(src);
+    return result;
+}
+
+/* Check the part of a data packet that lies below have, the size of the
+ * partial file being resumed, against what is already on disk. Data below
+ * verifyFrom is taken on trust. Returns 0 if the data matches.
+ */
+static int resume_compare(int cmp, struct tf_packet *p, __u64 have,
+                          __u64 verifyFrom)
+{
+    static __thread __u8 buf[MAXIMUM_PACKET_SIZE];
+    __u64 offset = get_u64(p->data);
+    __u16 dataLen = get_u16(&p->length) - (PACKET_HEAD_SIZE + 8);
+    __u64 from = (offset > verifyFrom) ? offset : verifyFrom;
+    __u64 to = MIN(offset + dataLen, have);
+    ssize_t r;
+
+    if(from >= to)
+    {
+        return 0;
+    }
+
+    r = pread64(cmp, buf, to - from, from);
+    if(r != (ssize_t) (to - from))
+    {
+        fprintf(stderr, "ERROR: Can not read partial file: %s\n",
+                (r < 0) ? strerror(errno) : "Short read");
+        return -1;
+    }
+
+    if(0 != memcmp(buf, &p->data[8 + (from - offset)], to - from))
+    {
+        fprintf(stderr,
+                "ERROR: Partial file does not match the source near offset %llu\n",
+                from);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns 1 if path is stdout ("-") or a FIFO, which can only be written in
+ * order and can not be truncated, stamped or resumed. */
+static int is_stream_path(const char *path)
+{
+    struct stat64 st;
+
+    return (0 == strcmp(path, "-")) ||
+        ((0 == stat64(path, &st)) && S_ISFIFO(st.st_mode));
+}
+
+/* Fetch a file from the device. If hash is given, the file data is hashed
+ * as it arrives. A non-zero from fetches only what lies past it, appending
+ * to what the destination already holds. If end is given, it is set to the
+ * offset just past the data written. */
+static int hdd_file_get(int fd, char *srcPath, char *dstPath,
+                        struct archive_hash *hash, __u64 from, __u64 *end)
+{
+    int result = -EPROTO;
+    time_t startTime = time(NULL);
+    enum
+    {
+        START,
+        DATA,
+        ABORT
+    } state;
+    int dst = -1;
+    int cmp = -1;
+    int r;
+    int update = 0;
+    __u64 byteCount = 0;
+    __u64 have = 0;
+    __u64 verifyFrom = 0;
+    __u64 expect = 0;
+    int first = 1;
+    struct utimbuf mod_utime_buf = { 0, 0 };
+    struct tf_packet *p = &reply;
+    struct ingest in;
+    int useWriter = 0;
+    int openFlags = O_WRONLY | O_CREAT | ((resume || from) ? 0 : O_TRUNC);
+    int stream = is_stream_path(dstPath);
+    struct sigaction oldPipe;
+
+    if(stream)
+    {
+        if(resume && (from == 0))
+        {
+            fprintf(stderr, "ERROR: Can not resume a get to %s\n", dstPath);
+            return -EINVAL;
+        }
+
+        /* Data goes out in order as it arrives. A slow reader holds up the
+           transfer once the ingest ring is full, so nothing piles up. */
+        if(0 == strcmp(dstPath, "-"))
+        {
+            fflush(stdout);
+            dst = dup(STDOUT_FILENO);
+        }
+        else
+        {
+            dst = open64(dstPath, O_WRONLY);
+        }
+    }
+    else
+    {
+        dst = open64(dstPath, openFlags | (directIo ? O_DIRECT : 0),
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH |
+                     S_IWOTH);
+        if((dst < 0) && directIo && (errno == EINVAL))
+        {
+            /* Not every file system supports O_DIRECT */
+            trace(1, fprintf(stderr, "O_DIRECT not supported for %s\n",
+                             dstPath));
+            dst = open64(dstPath, openFlags,
+                         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH |
+                         S_IWOTH);
+        }
+    }
+    if(dst < 0)
+    {
+        fprintf(stderr, "ERROR: Can not open destination file: %s\n",
+                strerror(errno));
+        return errno;
+    }
+
+    /* A reader that goes away must end the transfer cleanly, with a
+       cancel, rather than kill puppy part way through it. */
+    if(stream)
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &sa, &oldPipe);
+    }
+
+    /* What lies below from is taken on trust */
+    have = from;
+    verifyFrom = from;
+    expect = from;
+
+    if((resume || from) && !stream)
+    {
+        struct stat64 st;
+
+        /* Read back through a separate buffered descriptor, which is not
+           bound by O_DIRECT alignment rules. */
+        cmp = open64(dstPath, O_RDWR);
+        if((cmp < 0) || (0 != fstat64(cmp, &st)))
+        {
+            fprintf(stderr, "ERROR: Can not read partial file: %s\n",
+                    strerror(errno));
+            result = -errno;
+            if(cmp >= 0)
+            {
+                close(cmp);
+            }
+            close(dst);
+            return result;
+        }
+
+        /* Ask for a little of what is already there, to be sure that the
+           partial file really is the start of this one. */
+        if(from == 0)
+        {
+            have = st.st_size;
+            verifyFrom = (have > RESUME_VERIFY) ? (have - RESUME_VERIFY) : 0;
+            expect = verifyFrom;
+            trace(1, fprintf(stderr, "Resuming %s at offset %llu\n",
+                             dstPath, have));
+        }
+    }
+
+    /* Hand the file data to a writer thread, along with CRC checking if
+       requested. Falls back to writing from this thread. */
+    useWriter = (0 == ingest_start(&in, dst, crcWorker && !ignore_crc,
+                                   crcStrict));
+    defer_crc = useWriter && crcWorker && !ignore_crc && (have == 0);
+    if(!useWriter && directIo)
+    {
+        /* Plain write() of packet payloads can not meet O_DIRECT alignment */
+        fcntl(dst, F_SETFL, fcntl(dst, F_GETFL) & ~O_DIRECT);
+    }
+
+    /* Queue reads before asking for the file, so that the first packet
+       already has somewhere to go. Falls back to synchronous reads. */
+    usb_read_queue_start(fd, 0x82);
+
+    if(verifyFrom > 0)
+    {
+        r = send_cmd_hdd_file_send_with_offset(fd, GET, srcPath, verifyFrom);
+    }
+    else
+    {
+        r = send_cmd_hdd_file_send(fd, GET, srcPath);
+    }
+    if(r < 0)
+    {
+        goto out;
+    }
+
+    state = START;
+    while(0 < (r = get_tf_packet_queued(fd, &reply, &p)))
+    {
+        update = (update + 1) % 16;
+        switch (get_u32(&p->cmd))
+        {
+            case DATA_HDD_FILE_START:
+                if(state == START)
+                {
+                    struct typefile *tf = (struct typefile *) p->data;
+
+                    byteCount = get_u64(&tf->size);
+                    mod_utime_buf.actime = mod_utime_buf.modtime =
+                        tfdt_to_time(&tf->stamp);
+
+                    if(have > byteCount)
+                    {
+                        fprintf(stderr,
+                                "ERROR: Partial file is larger than the source\n");
+                        send_cancel(fd);
+                        state = ABORT;
+                        break;
+                    }
+
+                    /* Reserve the whole file up front to limit
+                       fragmentation. The file size is left alone, so an
+                       interrupted get still shows how much arrived. */
+                    if(preallocate && !stream && (byteCount > 0) &&
+                       (0 != fallocate(dst, FALLOC_FL_KEEP_SIZE, 0,
+                                       byteCount)))
+                    {
+                        trace(1, fprintf(stderr,
+                                         "Can not preallocate %s: %s\n",
+                                         dstPath, strerror(errno)));
+                    }
+
+                    send_success(fd);
+                    state = DATA;
+                }
+                else
+                {
+                    fprintf(stderr,
+                            "ERROR: Unexpected DATA_HDD_FILE_START packet in state %d\n",
+                            state);
+                    send_cancel(fd);
+                    state = ABORT;
+                }
+                break;
+
+            case DATA_HDD_FILE_DATA:
+                if(state == DATA)
+                {
+                    __u64 offset = get_u64(p->data);
+                    __u16 dataLen =
+                        get_u16(&p->length) - (PACKET_HEAD_SIZE + 8);
+                    ssize_t w;
+
+                    if(!update && !quiet)
+                    {
+                        progressStats(byteCount, offset + dataLen, startTime);
+                    }
+
+                    if(r < get_u16(&p->length))
+                    {
+                        fprintf(stderr,
+                                "ERROR: Short packet %d instead of %d\n", r,
+                                get_u16(&p->length));
+                        /* TODO: Fetch the rest of the packet */
+                    }
+
+                    /* Data must follow on exactly. Only the first packet
+                       may start early, for firmware that ignores the
+                       requested offset. */
+                    if((offset != expect) && !(first && (offset < expect)))
+                    {
+                        fprintf(stderr,
+                                "ERROR: %s in file data at offset %llu, expected %llu\n",
+                                (offset > expect) ? "Gap" : "Overlap",
+                                offset, expect);
+                        send_cancel(fd);
+                        state = ABORT;
+                        break;
+                    }
+                    if(first && (offset < verifyFrom))
+                    {
+                        trace(1, fprintf(stderr,
+                                         "Device ignored the resume offset\n"));
+                    }
+                    first = 0;
+                    expect = offset + dataLen;
+
+                    /* Packets from below the resume point are only compared,
+                       apart from any part that runs past it. The writer only
+                       sees packets from there on, so it can check the CRC of
+                       the next packet if that starts past it. */
+                    defer_crc = useWriter && crcWorker && !ignore_crc &&
+                        (expect >= have);
+                    if(offset < have)
                     {
-                        int payloadSize = sizeof(packet.data) - 9;
-                        ssize_t w = read(src, &packet.data[8], payloadSize);
-
-                        /* Detect a Topfield protcol bug and prevent the sending of packets
-                           that are a multiple of 512 bytes. */
-                        if((w > 4)
-                           &&
-                           (((((PACKET_HEAD_SIZE + 8 + w) +
-                               1) & ~1) % 0x200) == 0))
+                        if(0 != resume_compare(cmp, p, have, verifyFrom))
+                        {
+                            send_cancel(fd);
+                            state = ABORT;
+                            break;
+                        }
+                        if(expect <= have)
                         {
-                            lseek64(src, -4, SEEK_CUR);
-                            w -= 4;
-                            payloadSize -= 4;
+                            break;
                         }
+                    }
 
-                        put_u16(&packet.length, PACKET_HEAD_SIZE + 8 + w);
-                        put_u32(&packet.cmd, DATA_HDD_FILE_DATA);
-                        put_u64(packet.data, byteCount);
-                        byteCount += w;
+                    if((hash != NULL) && (have == 0))
+                    {
+                        archive_hash_update(hash, &p->data[8], dataLen);
+                    }
 
-                        /* Detect EOF and transition to END */
-                        if((w < 0) || (byteCount >= fileSize))
+                    if((offset >= have) && useWriter)
+                    {
+                        /* The writer reports its own errors */
+                        if(0 != ingest_push(&in, p))
                         {
-                            state = END;
+                            send_cancel(fd);
+                            state = ABORT;
                         }
+                    }
+                    else
+                    {
+                        __u64 skip = (offset < have) ? (have - offset) : 0;
 
-                        if(w > 0)
+                        /* A packet that straddles the resume point goes
+                           through the buffered descriptor, as its tail is
+                           not aligned for O_DIRECT. */
+                        if(stream)
                         {
-                            trace(3,
-                                  fprintf(stderr, "%s: DATA_HDD_FILE_DATA\n",
-                                          __func__));
-                            r = send_tf_packet(fd, &packet);
-                            if(r < w)
-                            {
-                                fprintf(stderr, "ERROR: Incomplete send.\n");
-                                goto out;
-                            }
+                            w = write(dst, &p->data[8 + skip],
+                                      dataLen - skip);
                         }
-
-                        if(!update && !quiet)
+                        else
                         {
-                            progressStats(fileSize, byteCount, startTime);
+                            w = pwrite64((skip > 0) ? cmp : dst,
+                                         &p->data[8 + skip], dataLen - skip,
+                                         offset + skip);
                         }
-                        break;
-                    }
-
-                    case END:
-                        /* Send end */
-                        put_u16(&packet.length, PACKET_HEAD_SIZE);
-                        put_u32(&packet.cmd, DATA_HDD_FILE_END);
-                        trace(3,
-                              fprintf(stderr, "%s: DATA_HDD_FILE_END\n",
-                                      __func__));
-                        r = send_tf_packet(fd, &packet);
-                        if(r < 0)
+                        if(w < (ssize_t) (dataLen - skip))
                         {
-                            fprintf(stderr, "ERROR: Incomplete send.\n");
-                            goto out;
+                            /* Can't write data - abort transfer */
+                            fprintf(stderr,
+                                    "ERROR: Can not write data: %s\n",
+                                    strerror(errno));
+                            send_cancel(fd);
+                            state = ABORT;
                         }
-                        state = FINISHED;
-                        break;
-
-                    case FINISHED:
-                        result = 0;
-                        goto out;
-                        break;
+                    }
+                }
+                else
+                {
+                    fprintf(stderr,
+                            "ERROR: Unexpected DATA_HDD_FILE_DATA packet in state %d\n",
+                            state);
+                    send_cancel(fd);
+                    state = ABORT;
                 }
                 break;
 
+            case DATA_HDD_FILE_END:
+                send_success(fd);
+                finalStats((expect > have) ? (expect - have) : 0, startTime);
+                result = 0;
+                goto out;
+                break;
+
             case FAIL:
                 fprintf(stderr, "ERROR: Device reports %s\n",
-                        decode_error(&reply));
+                        decode_error(p));
+                send_cancel(fd);
+                state = ABORT;
+                break;
+
+            case SUCCESS:
                 goto out;
                 break;
 
             default:
-                fprintf(stderr, "ERROR: Unhandled packet\n");
-                break;
+                fprintf(stderr, "ERROR: Unhandled packet (cmd 0x%x)\n",
+                        get_u32(&p->cmd));
         }
     }
+    /* Let the writer catch up before stamping the modification time. */
+    if(useWriter)
+    {
+        ingest_finish(&in);
+    }
+    if(!stream)
+    {
+        utime(dstPath, &mod_utime_buf);
+    }
     finalStats(byteCount, startTime);
 
   out:
-    close(src);
+    usb_read_queue_stop(fd);
+    if(useWriter)
+    {
+        defer_crc = 0;
+        if((0 != ingest_finish(&in)) && (result == 0))
+        {
+            result = -EIO;
+        }
+    }
+    if(cmp >= 0)
+    {
+        close(cmp);
+    }
+    close(dst);
+    if(stream)
+    {
+        sigaction(SIGPIPE, &oldPipe, NULL);
+    }
+    if(end != NULL)
+    {
+        *end = (expect > have) ? expect : have;
+    }
     return result;
 }
 
-int do_hdd_file_get(int fd, char *srcPath, char *dstPath)
+/* Deliver the length bytes of a remote file that start at offset to
+ * handler, by starting a get there and cancelling it once the range has
+ * arrived. A range that runs to the end of the file is cut to fit and
+ * finishes normally instead. Sets size to the size of the file and got to
+ * the number of bytes delivered. If skipEarly is set, data from before the
+ * offset, sent by firmware that ignores it, is passed over; otherwise that
+ * gives -ENOTSUP. */
+static int hdd_file_range(int fd, char *path, __u64 offset, __u64 length,
+                          int skipEarly, range_handler handler, void *ctx,
+                          __u64 *size, __u64 *got)
 {
     int result = -EPROTO;
-    time_t startTime = time(NULL);
+    int toEnd = 0;
+    int first = 1;
+    __u64 expect = offset;
+    int r;
     enum
     {
         START,
         DATA,
         ABORT
     } state;
-    int dst = -1;
-    int r;
-    int update = 0;
-    __u64 byteCount = 0;
-    struct utimbuf mod_utime_buf = { 0, 0 };
 
-    dst = open64(dstPath, O_WRONLY | O_CREAT | O_TRUNC,
-                 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-    if(dst < 0)
+    *got = 0;
+    if(offset > 0)
     {
-        fprintf(stderr, "ERROR: Can not open destination file: %s\n",
-                strerror(errno));
-        return errno;
+        r = send_cmd_hdd_file_send_with_offset(fd, GET, path, offset);
+    }
+    else
+    {
+        r = send_cmd_hdd_file_send(fd, GET, path);
     }
-
-    r = send_cmd_hdd_file_send(fd, GET, srcPath);
     if(r < 0)
     {
-        goto out;
+        return -EPROTO;
     }
 
     state = START;
     while(0 < (r = get_tf_packet(fd, &reply)))
     {
-        update = (update + 1) % 16;
         switch (get_u32(&reply.cmd))
         {
             case DATA_HDD_FILE_START:
@@ -735,18 +2428,24 @@ int do_hdd_file_get(int fd, char *srcPath, char *dstPath)
                 {
                     struct typefile *tf = (struct typefile *) reply.data;
 
-                    byteCount = get_u64(&tf->size);
-                    mod_utime_buf.actime = mod_utime_buf.modtime =
-                        tfdt_to_time(&tf->stamp);
-
+                    *size = get_u64(&tf->size);
+                    if((offset >= *size) || (length == 0))
+                    {
+                        result = 0;
+                        send_cancel(fd);
+                        state = ABORT;
+                        break;
+                    }
+                    if(length >= *size - offset)
+                    {
+                        length = *size - offset;
+                        toEnd = 1;
+                    }
                     send_success(fd);
                     state = DATA;
                 }
                 else
                 {
-                    fprintf(stderr,
-                            "ERROR: Unexpected DATA_HDD_FILE_START packet in state %d\n",
-                            state);
                     send_cancel(fd);
                     state = ABORT;
                 }
@@ -755,72 +2454,334 @@ int do_hdd_file_get(int fd, char *srcPath, char *dstPath)
             case DATA_HDD_FILE_DATA:
                 if(state == DATA)
                 {
-                    __u64 offset = get_u64(reply.data);
+                    __u64 at = get_u64(reply.data);
                     __u16 dataLen =
                         get_u16(&reply.length) - (PACKET_HEAD_SIZE + 8);
-                    ssize_t w;
+                    __u64 skip;
+                    __u64 n;
 
-                    if(!update && !quiet)
+                    if(first && (at != offset))
                     {
-                        progressStats(byteCount, offset + dataLen, startTime);
+                        trace(1, fprintf(stderr,
+                                         "Get of %s from %llu started at %llu\n",
+                                         path, offset, at));
+                        if(!skipEarly || (at > offset))
+                        {
+                            result = -ENOTSUP;
+                            send_cancel(fd);
+                            state = ABORT;
+                            break;
+                        }
+                        expect = at;
                     }
+                    first = 0;
 
-                    if(r < get_u16(&reply.length))
+                    if(at != expect)
                     {
                         fprintf(stderr,
-                                "ERROR: Short packet %d instead of %d\n", r,
-                                get_u16(&reply.length));
-                        /* TODO: Fetch the rest of the packet */
+                                "ERROR: %s in file data at offset %llu, expected %llu\n",
+                                (at > expect) ? "Gap" : "Overlap", at,
+                                expect);
+                        send_cancel(fd);
+                        state = ABORT;
+                        break;
+                    }
+                    expect = at + dataLen;
+                    if(expect <= offset)
+                    {
+                        break;
                     }
 
-                    w = write(dst, &reply.data[8], dataLen);
-                    if(w < dataLen)
+                    skip = (at < offset) ? (offset - at) : 0;
+                    n = MIN(dataLen - skip, length - *got);
+                    r = handler(&reply.data[8 + skip], n, ctx);
+                    if(r != 0)
                     {
-                        /* Can't write data - abort transfer */
-                        fprintf(stderr, "ERROR: Can not write data: %s\n",
-                                strerror(errno));
+                        result = r;
+                        send_cancel(fd);
+                        state = ABORT;
+                        break;
+                    }
+
+                    *got += n;
+                    if((*got == length) && !toEnd)
+                    {
+                        result = 0;
                         send_cancel(fd);
                         state = ABORT;
                     }
-                }
-                else
-                {
-                    fprintf(stderr,
-                            "ERROR: Unexpected DATA_HDD_FILE_DATA packet in state %d\n",
-                            state);
-                    send_cancel(fd);
-                    state = ABORT;
                 }
                 break;
 
             case DATA_HDD_FILE_END:
                 send_success(fd);
-                result = 0;
-                goto out;
+                return (state == DATA) ? 0 : result;
                 break;
 
             case FAIL:
-                fprintf(stderr, "ERROR: Device reports %s\n",
-                        decode_error(&reply));
-                send_cancel(fd);
-                state = ABORT;
+                if(state != ABORT)
+                {
+                    fprintf(stderr, "ERROR: Device reports %s\n",
+                            decode_error(&reply));
+                    send_cancel(fd);
+                    state = ABORT;
+                }
+                break;
+
+            case SUCCESS:
+                return result;
                 break;
 
-            case SUCCESS:
-                goto out;
-                break;
+            default:
+                fprintf(stderr, "ERROR: Unhandled packet (cmd 0x%x)\n",
+                        get_u32(&reply.cmd));
+        }
+    }
+    return -EPROTO;
+}
+
+struct range_buffer
+{
+    __u8 *buf;
+    __u64 used;
+};
+
+static int range_to_buffer(const __u8 *data, int len, void *ctx)
+{
+    struct range_buffer *rb = ctx;
+
+    memcpy(&rb->buf[rb->used], data, len);
+    rb->used += len;
+    return 0;
+}
+
+/* Read up to len bytes of a remote file from offset into buf. Sets size to
+ * the size of the file. Returns the number of bytes read, which is less
+ * than len only at the end of the file, or a negative error. Firmware that
+ * ignores the offset gives -ENOTSUP, rather than a transfer of everything
+ * before it. */
+int hdd_file_read_range(int fd, char *path, __u64 offset, __u8 *buf,
+                        int len, __u64 *size)
+{
+    struct range_buffer rb = { buf, 0 };
+    __u64 got;
+    int r;
+
+    r = hdd_file_range(fd, path, offset, len, 0, range_to_buffer, &rb, size,
+                       &got);
+    return (r == 0) ? (int) got : r;
+}
+
+static int range_to_file(const __u8 *data, int len, void *ctx)
+{
+    int *dst = ctx;
+
+    while(len > 0)
+    {
+        ssize_t w = write(*dst, data, len);
+
+        if(w < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "ERROR: Can not write data: %s\n",
+                    strerror(errno));
+            return -errno;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* Get length bytes of a remote file from offset into a file of their own,
+ * or to stdout or a FIFO. A length of RANGE_TO_END takes the rest of the
+ * file. */
+int do_hdd_file_get_range(int fd, char *srcPath, char *dstPath,
+                          __u64 offset, __u64 length)
+{
+    time_t startTime = time(NULL);
+    int stream = is_stream_path(dstPath);
+    struct sigaction oldPipe;
+    __u64 size = 0;
+    __u64 got = 0;
+    int dst;
+    int r;
+
+    if(0 == strcmp(dstPath, "-"))
+    {
+        fflush(stdout);
+        dst = dup(STDOUT_FILENO);
+    }
+    else
+    {
+        dst = open64(dstPath, O_WRONLY | O_CREAT | (stream ? 0 : O_TRUNC),
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH |
+                     S_IWOTH);
+    }
+    if(dst < 0)
+    {
+        fprintf(stderr, "ERROR: Can not open destination file: %s\n",
+                strerror(errno));
+        return -errno;
+    }
+
+    if(stream)
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &sa, &oldPipe);
+    }
+
+    r = hdd_file_range(fd, srcPath, offset, length, 1, range_to_file, &dst,
+                       &size, &got);
+    if(r == 0)
+    {
+        trace(1, fprintf(stderr, "Got %llu bytes from %llu of %s (%llu)\n",
+                         got, offset, srcPath, size));
+        finalStats(got, startTime);
+    }
+
+    if(stream)
+    {
+        sigaction(SIGPIPE, &oldPipe, NULL);
+    }
+    if((0 != close(dst)) && (r == 0))
+    {
+        r = -errno;
+    }
+    return r;
+}
+
+/* Get a file into the archive store. A file that the store already seems
+ * to hold, going by its size and samples of its data, is linked instead of
+ * being transferred again; that match is trusted without reading the rest
+ * of the file. Anything else is fetched, hashed on the way, and entered
+ * into the store. */
+static int archive_get(int fd, char *srcPath, char *dstPath)
+{
+    struct archive a;
+    struct archive_probe *probe;
+    struct archive_hash ah;
+    __u64 hash;
+    __u64 size = 0;
+    int sampled = 0;
+    int i;
+    int r;
+
+    r = archive_open(&a, archivePath);
+    if(r != 0)
+    {
+        return r;
+    }
+    probe = malloc(sizeof(*probe));
+    if(probe == NULL)
+    {
+        archive_close(&a);
+        return -ENOMEM;
+    }
+
+    /* Sampling costs a few packets, against the whole file */
+    r = hdd_file_read_range(fd, srcPath, 0, probe->sample[0], ARCHIVE_SAMPLE,
+                            &size);
+    if((r == ARCHIVE_SAMPLE) && archive_sample_offsets(probe, size))
+    {
+        sampled = 1;
+        for(i = 1; sampled && (i < ARCHIVE_SAMPLES); i++)
+        {
+            r = hdd_file_read_range(fd, srcPath, probe->offset[i],
+                                    probe->sample[i], ARCHIVE_SAMPLE, &size);
+            sampled = (r == ARCHIVE_SAMPLE) && (size == probe->size);
+        }
+    }
+
+    if(sampled)
+    {
+        r = archive_find(&a, probe, dstPath);
+        if(r != 0)
+        {
+            if((r > 0) && !quiet)
+            {
+                fprintf(stderr, "%s is already archived\n", dstPath);
+            }
+            r = (r > 0) ? 0 : r;
+            goto out;
+        }
+    }
+
+    /* The hash of a resumed file has to come from what is on disk */
+    archive_hash_init(&ah);
+    r = hdd_file_get(fd, srcPath, dstPath, resume ? NULL : &ah, 0, NULL);
+    if(r == 0)
+    {
+        if(resume)
+        {
+            r = archive_hash_file(dstPath, &hash, &size);
+        }
+        else
+        {
+            hash = archive_hash_final(&ah);
+            size = ah.length;
+        }
+    }
+    if(r == 0)
+    {
+        r = archive_add(&a, dstPath, hash, size, sampled ? probe : NULL);
+    }
+
+  out:
+    free(probe);
+    archive_close(&a);
+    return r;
+}
+
+/* Get a file that may still be growing, such as a recording in progress.
+ * After the first transfer the size is polled every FOLLOW_INTERVAL
+ * seconds, and whatever has been added is fetched from where the last
+ * transfer ended, until a poll finds that the file has stopped growing. */
+static int follow_get(int fd, char *srcPath, char *dstPath)
+{
+    __u64 have = 0;
+    __u64 size;
+    int r;
 
-            default:
-                fprintf(stderr, "ERROR: Unhandled packet (cmd 0x%x)\n",
-                        get_u32(&reply.cmd));
+    r = hdd_file_get(fd, srcPath, dstPath, NULL, 0, &have);
+    while(r == 0)
+    {
+        sleep(FOLLOW_INTERVAL);
+        r = hdd_file_size(fd, srcPath, &size);
+        if((r != 0) || (size <= have))
+        {
+            break;
         }
+
+        trace(1, fprintf(stderr, "%s has grown to %llu bytes\n", srcPath,
+                         size));
+        r = hdd_file_get(fd, srcPath, dstPath, NULL, have, &have);
     }
-    utime(dstPath, &mod_utime_buf);
-    finalStats(byteCount, startTime);
 
-  out:
-    close(dst);
-    return result;
+    if((r == 0) && !quiet)
+    {
+        fprintf(stderr, "%s stopped growing at %llu bytes\n", srcPath, have);
+    }
+    return r;
+}
+
+int do_hdd_file_get(int fd, char *srcPath, char *dstPath)
+{
+    if(follow)
+    {
+        return follow_get(fd, srcPath, dstPath);
+    }
+    if((archivePath != NULL) && !is_stream_path(dstPath))
+    {
+        return archive_get(fd, srcPath, dstPath);
+    }
+    return hdd_file_get(fd, srcPath, dstPath, NULL, 0, NULL);
 }
 
 int do_hdd_del(int fd, char *path)
@@ -919,10 +2880,281 @@ int do_hdd_mkdir(int fd, char *path)
     return -EPROTO;
 }
 
+/* The local destination of a command for one of several devices, with the
+ * device name inserted as a subdirectory: a directory becomes dir/name and
+ * a file dir/file becomes dir/name/file. */
+static char *device_local_path(const char *path, const char *name, int isDir)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    char *result;
+
+    if(isDir)
+    {
+        if((0 != mkdir(path, 0777)) && (errno != EEXIST))
+        {
+            fprintf(stderr, "ERROR: Can not create %s: %s\n", path,
+                    strerror(errno));
+            return NULL;
+        }
+        return join_path(path, '/', name);
+    }
+
+    if(slash != NULL)
+    {
+        char *parent = strndup(path, slash - path + 1);
+
+        if(parent == NULL)
+        {
+            return NULL;
+        }
+        dir = join_path(parent, '/', name);
+        free(parent);
+    }
+    else
+    {
+        dir = strdup(name);
+    }
+    if(dir == NULL)
+    {
+        return NULL;
+    }
+
+    if((0 != mkdir(dir, 0777)) && (errno != EEXIST))
+    {
+        fprintf(stderr, "ERROR: Can not create %s: %s\n", dir,
+                strerror(errno));
+        free(dir);
+        return NULL;
+    }
+    result = join_path(dir, '/', (slash != NULL) ? (slash + 1) : path);
+    free(dir);
+    return result;
+}
+
+static void *device_thread(void *arg)
+{
+    struct device_run *d = arg;
+    int fd;
+
+    thisDevice = d;
+    fd = openToppy(d->dev.path);
+    if(fd < 0)
+    {
+        d->result = -fd;
+    }
+    else
+    {
+        d->result = runCommandWith(fd, arg1,
+                                   (d->dstPath != NULL) ? d->dstPath : arg2,
+                                   (d->indexPath !=
+                                    NULL) ? d->indexPath : arg3);
+        closeToppy(fd);
+    }
+
+    pthread_mutex_lock(&runLock);
+    d->endTime = time(NULL);
+    d->running = 0;
+    pthread_cond_broadcast(&runCond);
+    pthread_mutex_unlock(&runLock);
+    return NULL;
+}
+
+static void device_stats(const char *name, __u64 bytes, int delta)
+{
+    if(delta <= 0)
+    {
+        delta = 1;
+    }
+    fprintf(stderr, "%s: %.2f Mbytes in %02d:%02d:%02d (%.2f Mbits/s)\n",
+            name, (double) bytes / (1000.0 * 1000.0), delta / (60 * 60),
+            (delta / 60) % 60, delta % 60,
+            ((bytes * 8.0) / delta) / (1000.0 * 1000.0));
+}
+
+/* Run the command on every Toppy found, each from a thread of its own, so
+ * that a rack of devices is worked on at once. Files fetched from each
+ * device go to a subdirectory named after its bus-port. Reports the
+ * throughput of each device and of all of them together. */
+int runAll(void)
+{
+    struct toppy found[MAX_TOPPIES];
+    struct device_run *runs;
+    time_t startTime = time(NULL);
+    int localDst = (cmd == CMD_SYNC) ||
+        ((cmd == CMD_HDD_FILE_SEND) && (sendDirection == GET));
+    int result = 0;
+    int count;
+    int running;
+    int i;
+
+    if(localDst && (0 == strcmp(arg2, "-")))
+    {
+        fprintf(stderr, "ERROR: Can not stream from several devices at once\n");
+        return E_INVALID_ARGS;
+    }
+
+    count = scanToppies(found, MAX_TOPPIES);
+    if(count <= 0)
+    {
+        if(count == 0)
+        {
+            fprintf(stderr, "ERROR: Can not autodetect a Topfield TF5000PVRt\n");
+        }
+        return E_INVALID_ARGS;
+    }
+
+    /* Let other instances know about this one, as for a single device */
+    if(0 != flock(lockFd, LOCK_SH | LOCK_NB))
+    {
+        fprintf(stderr,
+                "ERROR: Can not obtain shared lock on /tmp/puppy: %s\n",
+                strerror(errno));
+        return E_GLOBAL_LOCK;
+    }
+
+    runs = calloc(count, sizeof(*runs));
+    if(runs == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        struct device_run *d = &runs[i];
+        int r;
+
+        d->dev = found[i];
+        d->startTime = time(NULL);
+        if(localDst)
+        {
+            d->dstPath = device_local_path(arg2, d->dev.name,
+                                           recursive || (cmd == CMD_SYNC));
+            if(d->dstPath == NULL)
+            {
+                d->result = -ENOMEM;
+                continue;
+            }
+        }
+        if((cmd == CMD_SYNC) && (arg3 != NULL))
+        {
+            d->indexPath = malloc(strlen(arg3) + strlen(d->dev.name) + 2);
+            if(d->indexPath == NULL)
+            {
+                d->result = -ENOMEM;
+                continue;
+            }
+            sprintf(d->indexPath, "%s.%s", arg3, d->dev.name);
+        }
+
+        trace(1, fprintf(stderr, "Starting %s on %s\n", d->dev.name,
+                         d->dev.path));
+        d->running = 1;
+        r = pthread_create(&d->thread, NULL, device_thread, d);
+        if(r != 0)
+        {
+            fprintf(stderr, "ERROR: Can not start a thread for %s: %s\n",
+                    d->dev.name, strerror(r));
+            d->running = 0;
+            d->result = -r;
+        }
+        d->started = (r == 0);
+    }
+
+    /* Report on all of the devices together until they are done */
+    pthread_mutex_lock(&runLock);
+    for(;;)
+    {
+        struct timespec until;
+        __u64 bytes = 0;
+        int delta = time(NULL) - startTime;
+
+        running = 0;
+        for(i = 0; i < count; i++)
+        {
+            running += runs[i].running;
+            bytes += runs[i].done + runs[i].current;
+        }
+        if(running == 0)
+        {
+            break;
+        }
+
+        if(!quiet && (delta > 0))
+        {
+            fprintf(stderr,
+                    "\r%d of %d devices busy, %.2f Mbytes, %5.2f Mbits/s",
+                    running, count, (double) bytes / (1000.0 * 1000.0),
+                    ((bytes * 8.0) / delta) / (1000 * 1000));
+        }
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += ALL_REPORT_INTERVAL;
+        pthread_cond_timedwait(&runCond, &runLock, &until);
+    }
+    pthread_mutex_unlock(&runLock);
+
+    if(!quiet)
+    {
+        fprintf(stderr, "\n");
+    }
+    for(i = 0; i < count; i++)
+    {
+        struct device_run *d = &runs[i];
+
+        if(d->started)
+        {
+            pthread_join(d->thread, NULL);
+        }
+        if(d->result != 0)
+        {
+            fprintf(stderr, "%s: FAILED (%d)\n", d->dev.name, d->result);
+            if(result == 0)
+            {
+                result = d->result;
+            }
+        }
+        else if(!quiet)
+        {
+            device_stats(d->dev.name, d->done, d->endTime - d->startTime);
+        }
+    }
+
+    if(!quiet)
+    {
+        __u64 bytes = 0;
+        char name[32];
+
+        for(i = 0; i < count; i++)
+        {
+            bytes += runs[i].done;
+        }
+        sprintf(name, "All %d devices", count);
+        device_stats(name, bytes, time(NULL) - startTime);
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        free(runs[i].dstPath);
+        free(runs[i].indexPath);
+    }
+    free(runs);
+    return result;
+}
+
 void progressStats(__u64 totalSize, __u64 bytes, time_t startTime)
 {
     int delta = time(NULL) - startTime;
 
+    /* With several devices, runAll() reports for all of them */
+    if(thisDevice != NULL)
+    {
+        pthread_mutex_lock(&runLock);
+        thisDevice->current = bytes;
+        pthread_mutex_unlock(&runLock);
+        return;
+    }
+
     if(quiet)
         return;
 
@@ -944,6 +3176,15 @@ void finalStats(__u64 bytes, time_t startTime)
 {
     int delta = time(NULL) - startTime;
 
+    if(thisDevice != NULL)
+    {
+        pthread_mutex_lock(&runLock);
+        thisDevice->done += bytes;
+        thisDevice->current = 0;
+        pthread_mutex_unlock(&runLock);
+        return;
+    }
+
     if(quiet)
         return;
 
@@ -959,17 +3200,35 @@ void finalStats(__u64 bytes, time_t startTime)
 void usage(char *myName)
 {
     char *usageString =
-        "Usage: %s [-ipPqv] [-d <device>] -c <command> [args]\n"
+        "Usage: %s [-aiACFORSpPqrv] [-d <device>] [-H <store>] [-s <socket>] -c <command> [args]\n"
+        "       %s [-iACFORSkpPqrv] [-d <device>] [-H <store>] [-s <socket>] -b <file>\n"
+        "       %s [-v] [-d <device>] -L <socket>\n"
+        " -a             - run the command on every Toppy found, all at once\n"
         " -i             - ignore packet CRCs (for compatibility with USB accelerator patch)\n"
+        " -A             - preallocate disk space for files during get\n"
+        " -C             - check file data CRCs in a worker thread during get\n"
+        " -F             - follow a get of a growing file until it stops growing\n"
+        " -O             - write files with O_DIRECT during get, bypassing the page cache\n"
+        " -R             - resume an interrupted get or put from the partial file\n"
+        " -S             - abort get on a file data CRC error (implies -C)\n"
+        " -k             - keep going after a failed command in a batch\n"
         " -p             - packet header output to stderr\n"
         " -P             - full packet dump output to stderr\n"
         " -q             - quiet transfers - no progress updates\n"
+        " -r             - get or put a whole directory tree\n"
         " -v             - verbose output to stderr\n"
-        " -d <device>    - USB device, for example /dev/bus/usb/001/003\n"
-        " -c <command>   - one of size, dir, get, put, rename, delete, mkdir, reboot, cancel, turbo\n"
-        " args           - optional arguments, as required by each command\n\n"
+        " -b <file>      - run the commands in file, one per line, or - for stdin\n"
+        " -d <device>    - USB device, for example /dev/bus/usb/001/003,\n"
+        "                  or unix:<socket> for a puppy-emu device emulator\n"
+        " -H <store>     - get files into a content addressed store, linking duplicates\n"
+        " -L <socket>    - keep the device open and serve commands on a Unix socket\n"
+        " -s <socket>    - run the command through the session serving that socket\n"
+        " -c <command>   - one of size, dir, get, put, rename, delete, mkdir, reboot, cancel, turbo, sync\n"
+        " args           - optional arguments, as required by each command\n"
+        "                  get <src> <dst> [<offset> [<length>]] fetches only part of a file\n"
+        "                  (get writes to stdout when the destination is -)\n\n"
         "Version: " PUPPY_RELEASE ", Compiled: " __DATE__ "\n";
-    fprintf(stderr, usageString, myName);
+    fprintf(stderr, usageString, myName, myName, myName);
 }
 
 int parseArgs(int argc, char *argv[])
@@ -978,14 +3237,43 @@ int parseArgs(int argc, char *argv[])
     extern int optind;
     int c;
 
-    while((c = getopt(argc, argv, "ipPqvd:c:")) != -1)
+    while((c = getopt(argc, argv, "aiACFORSkpPqrvb:d:c:H:L:s:")) != -1)
     {
         switch (c)
         {
+            case 'a':
+                allToppies = 1;
+                break;
+
             case 'i':
                 ignore_crc = 1;
                 break;
 
+            case 'A':
+                preallocate = 1;
+                break;
+
+            case 'C':
+                crcWorker = 1;
+                break;
+
+            case 'F':
+                follow = 1;
+                break;
+
+            case 'O':
+                directIo = 1;
+                break;
+
+            case 'R':
+                resume = 1;
+                break;
+
+            case 'S':
+                crcWorker = 1;
+                crcStrict = 1;
+                break;
+
             case 'v':
                 verbose++;
                 break;
@@ -1002,37 +3290,36 @@ int parseArgs(int argc, char *argv[])
                 quiet = 1;
                 break;
 
+            case 'r':
+                recursive = 1;
+                break;
+
             case 'd':
                 devPath = optarg;
                 break;
 
+            case 'H':
+                archivePath = optarg;
+                break;
+
+            case 'L':
+                listenPath = optarg;
+                break;
+
+            case 's':
+                sessionPath = optarg;
+                break;
+
             case 'c':
-                if(!strcasecmp(optarg, "dir"))
-                    cmd = CMD_HDD_DIR;
-                else if(!strcasecmp(optarg, "cancel"))
-                    cmd = CANCEL;
-                else if(!strcasecmp(optarg, "size"))
-                    cmd = CMD_HDD_SIZE;
-                else if(!strcasecmp(optarg, "reboot"))
-                    cmd = CMD_RESET;
-                else if(!strcasecmp(optarg, "put"))
-                {
-                    cmd = CMD_HDD_FILE_SEND;
-                    sendDirection = PUT;
-                }
-                else if(!strcasecmp(optarg, "get"))
-                {
-                    cmd = CMD_HDD_FILE_SEND;
-                    sendDirection = GET;
-                }
-                else if(!strcasecmp(optarg, "delete"))
-                    cmd = CMD_HDD_DEL;
-                else if(!strcasecmp(optarg, "rename"))
-                    cmd = CMD_HDD_RENAME;
-                else if(!strcasecmp(optarg, "mkdir"))
-                    cmd = CMD_HDD_CREATE_DIR;
-                else if(!strcasecmp(optarg, "turbo"))
-                    cmd = CMD_TURBO;
+                cmdName = optarg;
+                break;
+
+            case 'b':
+                batchPath = optarg;
+                break;
+
+            case 'k':
+                keepGoing = 1;
                 break;
 
             default:
@@ -1041,28 +3328,98 @@ int parseArgs(int argc, char *argv[])
         }
     }
 
-    if(cmd == 0)
+    /* Several devices run a single command, and can not share a session */
+    if(((cmdName != NULL) && (batchPath != NULL)) ||
+       (allToppies && ((cmdName == NULL) || (devPath != NULL) ||
+                       (listenPath != NULL))))
     {
         usage(argv[0]);
         return -1;
     }
 
-    /* Search for a Toppy if the device is not specified */
-    if(devPath == NULL)
+    if(cmdName != NULL)
     {
-        devPath = findToppy();
+        if(0 != parseCommand(cmdName, argc - optind, &argv[optind]))
+        {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    else if((batchPath == NULL) &&
+            ((listenPath == NULL) || (sessionPath != NULL)))
+    {
+        /* A session daemon is the only thing that runs without a command */
+        usage(argv[0]);
+        return -1;
     }
 
-    if(devPath == NULL)
+    return 0;
+}
+
+/* Parse a decimal, or 0x prefixed hexadecimal, byte count. */
+static int parse_size(const char *s, __u64 *value)
+{
+    char *end;
+
+    errno = 0;
+    *value = strtoull(s, &end, 0);
+    return ((errno == 0) && (end != s) && (*end == '\0') && (s[0] != '-')) ?
+        0 : -1;
+}
+
+/* Pick out the command called name and its arguments. */
+int parseCommand(char *name, int argc, char *argv[])
+{
+    /* Nothing carries over from the previous line of a batch or session */
+    cmd = 0;
+    sendDirection = GET;
+    ranged = 0;
+    rangeOffset = 0;
+    rangeLength = RANGE_TO_END;
+    arg1 = NULL;
+    arg2 = NULL;
+    arg3 = NULL;
+
+    if(!strcasecmp(name, "dir"))
+        cmd = CMD_HDD_DIR;
+    else if(!strcasecmp(name, "cancel"))
+        cmd = CANCEL;
+    else if(!strcasecmp(name, "size"))
+        cmd = CMD_HDD_SIZE;
+    else if(!strcasecmp(name, "reboot"))
+        cmd = CMD_RESET;
+    else if(!strcasecmp(name, "put"))
+    {
+        cmd = CMD_HDD_FILE_SEND;
+        sendDirection = PUT;
+    }
+    else if(!strcasecmp(name, "get"))
+    {
+        cmd = CMD_HDD_FILE_SEND;
+        sendDirection = GET;
+    }
+    else if(!strcasecmp(name, "delete"))
+        cmd = CMD_HDD_DEL;
+    else if(!strcasecmp(name, "rename"))
+        cmd = CMD_HDD_RENAME;
+    else if(!strcasecmp(name, "mkdir"))
+        cmd = CMD_HDD_CREATE_DIR;
+    else if(!strcasecmp(name, "turbo"))
+        cmd = CMD_TURBO;
+    else if(!strcasecmp(name, "sync"))
+        cmd = CMD_SYNC;
+
+    if(cmd == 0)
     {
+        fprintf(stderr, "ERROR: Unknown command %s\n", name);
         return -1;
     }
 
     if(cmd == CMD_HDD_DIR)
     {
-        if(optind < argc)
+        if(0 < argc)
         {
-            arg1 = argv[optind];
+            arg1 = argv[0];
         }
         else
         {
@@ -1072,10 +3429,18 @@ int parseArgs(int argc, char *argv[])
 
     if(cmd == CMD_HDD_FILE_SEND)
     {
-        if((optind + 1) < argc)
+        /* Batch lines give -r after the command */
+        if((0 < argc) && (0 == strcmp(argv[0], "-r")))
+        {
+            recursive = 1;
+            argc--;
+            argv++;
+        }
+
+        if(1 < argc)
         {
-            arg1 = argv[optind];
-            arg2 = argv[optind + 1];
+            arg1 = argv[0];
+            arg2 = argv[1];
         }
         else
         {
@@ -1083,13 +3448,27 @@ int parseArgs(int argc, char *argv[])
                     "ERROR: Need both source and destination names.\n");
             return -1;
         }
+
+        /* get can take just part of a file */
+        if(2 < argc)
+        {
+            if((sendDirection != GET) || recursive || (4 < argc) ||
+               (0 != parse_size(argv[2], &rangeOffset)) ||
+               ((3 < argc) && (0 != parse_size(argv[3], &rangeLength))))
+            {
+                fprintf(stderr,
+                        "ERROR: Only get of a single file takes an offset and length.\n");
+                return -1;
+            }
+            ranged = 1;
+        }
     }
 
     if(cmd == CMD_HDD_DEL)
     {
-        if(optind < argc)
+        if(0 < argc)
         {
-            arg1 = argv[optind];
+            arg1 = argv[0];
         }
         else
         {
@@ -1101,10 +3480,10 @@ int parseArgs(int argc, char *argv[])
 
     if(cmd == CMD_HDD_RENAME)
     {
-        if((optind + 1) < argc)
+        if(1 < argc)
         {
-            arg1 = argv[optind];
-            arg2 = argv[optind + 1];
+            arg1 = argv[0];
+            arg2 = argv[1];
         }
         else
         {
@@ -1116,9 +3495,9 @@ int parseArgs(int argc, char *argv[])
 
     if(cmd == CMD_HDD_CREATE_DIR)
     {
-        if(optind < argc)
+        if(0 < argc)
         {
-            arg1 = argv[optind];
+            arg1 = argv[0];
         }
         else
         {
@@ -1127,11 +3506,27 @@ int parseArgs(int argc, char *argv[])
         }
     }
 
+    if(cmd == CMD_SYNC)
+    {
+        if(1 < argc)
+        {
+            arg1 = argv[0];
+            arg2 = argv[1];
+            arg3 = (2 < argc) ? argv[2] : NULL;
+        }
+        else
+        {
+            fprintf(stderr,
+                    "ERROR: Specify the remote directory and the local archive.\n");
+            return -1;
+        }
+    }
+
     if(cmd == CMD_TURBO)
     {
-        if(optind < argc)
+        if(0 < argc)
         {
-            arg1 = argv[optind];
+            arg1 = argv[0];
         }
         else
         {
@@ -1162,9 +3557,9 @@ int readsysfs(char* devname, char* item, char *value, int valuesize)
     return 1;
 }
 
-/* Find a Topfield PVR on the usb.  Return the device as a static string of the
- * form /dev/bus/usb/BBB/DDD or NULL if not found or other error. */
-char *findToppy(void)
+/* Find the Topfield PVRs on the usb, filling in up to max of them.  Return
+ * the number found, or -1 on error. */
+int scanToppies(struct toppy *found, int max)
 {
     DIR *devicesdir;
     struct dirent *direntry;
@@ -1172,18 +3567,16 @@ char *findToppy(void)
     char pid[5];
     char bus[5];
     char device[5];
-    static char pathBuffer[32];
+    int count = 0;
 
     /* Refuse to scan while another instance is running. */
     if(0 != flock(lockFd, LOCK_EX | LOCK_NB))
     {
         fprintf(stderr,
                 "ERROR: Can not scan for devices while another instance of puppy is running.\n");
-        return NULL;
+        return -1;
     }
 
-    pathBuffer[0] = '\0';  /* Signify nothing found at entry */
-
     /* Iterate over all usb devices, looking for Topfield */
     if (!(devicesdir = opendir("/sys/bus/usb/devices")))
     {
@@ -1191,7 +3584,7 @@ char *findToppy(void)
                 "ERROR: Can not perform autodetection.\n"
                 "ERROR: /sys/bus/usb/devices can not be opened.\n"
                 "ERROR: %s\n", strerror(errno));
-        return NULL;
+        return -1;
     }
 
     while ((direntry = readdir(devicesdir)))
@@ -1212,25 +3605,49 @@ char *findToppy(void)
         trace(1, fprintf(stderr, "Recognised Topfield device at bus-port=%s\n",
                                                 direntry->d_name));
 
-        /* Error if multiple matching devices found */
-        if (pathBuffer[0])
+        if (count == max)
         {
-            fprintf(stderr,
-                    "ERROR: Multiple Topfield devices recognised.\n"
-                    "ERROR: Please use the -d option to specify a device.\n");
-            return NULL;
+            fprintf(stderr, "WARNING: Only using the first %d Topfield devices\n",
+                    max);
+            break;
         }
 
-        /* Construct the device path for the first matching device */
+        /* Construct the device path */
         readsysfs(direntry->d_name, "busnum", bus, sizeof(bus));
         readsysfs(direntry->d_name, "devnum", device, sizeof(device));
-        sprintf(pathBuffer, "/dev/bus/usb/%03d/%03d", atoi(bus), atoi(device));
+        snprintf(found[count].name, SYSPATH_MAX, "%s", direntry->d_name);
+        sprintf(found[count].path, "/dev/bus/usb/%03d/%03d", atoi(bus),
+                atoi(device));
+        count++;
+    }
+    closedir(devicesdir);
+    return count;
+}
+
+/* Find a Topfield PVR on the usb.  Return the device as a static string of the
+ * form /dev/bus/usb/BBB/DDD or NULL if not found or other error. */
+char *findToppy(void)
+{
+    static struct toppy found[MAX_TOPPIES];
+    int count = scanToppies(found, MAX_TOPPIES);
 
-        /* Continue iterating, to check for multiple matching devices */
+    if (count < 0)
+    {
+        return NULL;
+    }
+
+    /* Error if multiple matching devices found */
+    if (count > 1)
+    {
+        fprintf(stderr,
+                "ERROR: Multiple Topfield devices recognised.\n"
+                "ERROR: Please use the -d option to specify a device, or -a for all of them.\n");
+        return NULL;
     }
-    if (pathBuffer[0])
+
+    if (count == 1)
     {
-        return pathBuffer;
+        return found[0].path;
     }
     else
     {
@@ -0,0 +1,536 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "session.h"
+#include "usb_io.h"
+
+/* A request carries the client's stdin, stdout, stderr and working
+   directory, in that order. */
+#define SESSION_FDS 4
+
+/* Seconds a client has to send its request, as requests are served one
+   at a time and a silent client would hold up every other one */
+#define SESSION_RECV_TIMEOUT 5
+
+static volatile sig_atomic_t stopping = 0;
+
+static void session_stop(int sig)
+{
+    (void) sig;
+    stopping = 1;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    __u8 *p = buf;
+
+    while(len > 0)
+    {
+        ssize_t r = read(fd, p, len);
+
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+        if(r == 0)
+        {
+            return -EPIPE;
+        }
+
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const __u8 *p = buf;
+
+    while(len > 0)
+    {
+        ssize_t w = write(fd, p, len);
+
+        if(w < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int make_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "ERROR: Socket path %s is too long\n", path);
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int elapsed_micros(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1000000 +
+        (t1.tv_nsec - t0->tv_nsec) / 1000;
+}
+
+/* Receive a request head along with the client's stdio and working
+ * directory. */
+static int recv_head(int conn, struct session_request_head *head,
+                     int fds[SESSION_FDS])
+{
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SESSION_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { head, sizeof(*head) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t r;
+    int count = 0;
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do
+    {
+        r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    }
+    while((r < 0) && (errno == EINTR));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if((r >= 0) && (cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) &&
+       (cmsg->cmsg_type == SCM_RIGHTS))
+    {
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), MIN(count, SESSION_FDS) * sizeof(int));
+    }
+
+    if((r != sizeof(*head)) || (count != SESSION_FDS) ||
+       (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    {
+        int err = (r < 0) ? -errno : (r == 0) ? -EPIPE : -EPROTO;
+
+        for(i = 0; i < MIN(count, SESSION_FDS); i++)
+        {
+            close(fds[i]);
+        }
+        return err;
+    }
+
+    return 0;
+}
+
+/* Run one request on behalf of a connected client. */
+static void serve_one(int conn, session_handler handler)
+{
+    struct session_request_head head;
+    struct session_reply reply;
+    struct timespec t0;
+    char *blob = NULL;
+    char *argv[SESSION_MAX_ARGS + 1];
+    int fds[SESSION_FDS];
+    int savedIn = -1;
+    int savedOut = -1;
+    int savedErr = -1;
+    int savedCwd = -1;
+    __u32 i;
+    __u32 pos;
+    int r;
+
+    r = recv_head(conn, &head, fds);
+    if(r != 0)
+    {
+        /* A connection that closes straight away is just a check that the
+           session is alive. */
+        if(r == -EAGAIN)
+        {
+            fprintf(stderr, "ERROR: Session client sent no request\n");
+        }
+        else if(r != -EPIPE)
+        {
+            fprintf(stderr, "ERROR: Malformed session request\n");
+        }
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if((head.argc == 0) || (head.argc > SESSION_MAX_ARGS) ||
+       (head.size == 0) || (head.size > SESSION_MAX_REQUEST) ||
+       (NULL == (blob = malloc(head.size))) ||
+       (0 != read_all(conn, blob, head.size)) ||
+       (blob[head.size - 1] != '\0'))
+    {
+        fprintf(stderr, "ERROR: Malformed session request\n");
+        goto out;
+    }
+
+    /* Split the arguments back out */
+    for(i = 0, pos = 0; (i < head.argc) && (pos < head.size); i++)
+    {
+        argv[i] = &blob[pos];
+        pos += strlen(argv[i]) + 1;
+    }
+    if((i != head.argc) || (pos != head.size))
+    {
+        fprintf(stderr, "ERROR: Malformed session request\n");
+        goto out;
+    }
+    argv[i] = NULL;
+
+    /* Switch over to the client's stdio and working directory */
+    fflush(stdout);
+    fflush(stderr);
+    __fpurge(stdin);
+    clearerr(stdin);
+    savedIn = dup(STDIN_FILENO);
+    savedOut = dup(STDOUT_FILENO);
+    savedErr = dup(STDERR_FILENO);
+    savedCwd = open(".", O_RDONLY | O_DIRECTORY);
+    if((savedIn < 0) || (savedOut < 0) || (savedErr < 0) || (savedCwd < 0) ||
+       (0 > dup2(fds[0], STDIN_FILENO)) ||
+       (0 > dup2(fds[1], STDOUT_FILENO)) ||
+       (0 > dup2(fds[2], STDERR_FILENO)) || (0 != fchdir(fds[3])))
+    {
+        reply.result = -errno;
+    }
+    else
+    {
+        reply.result = handler(head.argc, argv);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    /* Whatever the request left unread belongs to the client */
+    __fpurge(stdin);
+    clearerr(stdin);
+    if(savedIn >= 0)
+    {
+        dup2(savedIn, STDIN_FILENO);
+        close(savedIn);
+    }
+    if(savedOut >= 0)
+    {
+        dup2(savedOut, STDOUT_FILENO);
+        close(savedOut);
+    }
+    if(savedErr >= 0)
+    {
+        dup2(savedErr, STDERR_FILENO);
+        close(savedErr);
+    }
+    if(savedCwd >= 0)
+    {
+        if(0 != fchdir(savedCwd))
+        {
+            fprintf(stderr, "ERROR: Can not restore working directory: %s\n",
+                    strerror(errno));
+        }
+        close(savedCwd);
+    }
+
+    reply.micros = elapsed_micros(&t0);
+    write_all(conn, &reply, sizeof(reply));
+
+    /* One line per request, so that slow commands stand out */
+    for(i = 1; i < head.argc; i++)
+    {
+        fprintf(stderr, "%s%s", argv[i], (i + 1 < head.argc) ? " " : "");
+    }
+    fprintf(stderr, ": result %d in %.3f ms\n", reply.result,
+            reply.micros / 1000.0);
+
+  out:
+    free(blob);
+    for(i = 0; i < SESSION_FDS; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+/* Accept and run requests on a Unix socket at path until SIGINT or
+ * SIGTERM. Returns 0 on a clean shutdown. */
+int session_serve(const char *path, session_handler handler)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat st;
+    mode_t oldMask;
+    int lfd;
+    int r;
+
+    r = make_address(path, &addr);
+    if(r < 0)
+    {
+        return r;
+    }
+
+    lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(lfd < 0)
+    {
+        fprintf(stderr, "ERROR: Can not create socket: %s\n",
+                strerror(errno));
+        return -errno;
+    }
+
+    /* Clear away a socket left behind by a daemon that is no longer
+       running, but never take over from a live one. */
+    if((0 == lstat(path, &st)) && S_ISSOCK(st.st_mode))
+    {
+        if(0 == connect(lfd, (struct sockaddr *) &addr, sizeof(addr)))
+        {
+            fprintf(stderr, "ERROR: A session is already running on %s\n",
+                    path);
+            close(lfd);
+            return -EADDRINUSE;
+        }
+        unlink(path);
+        close(lfd);
+        lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(lfd < 0)
+        {
+            fprintf(stderr, "ERROR: Can not create socket: %s\n",
+                    strerror(errno));
+            return -errno;
+        }
+    }
+
+    /* Only the owner gets to drive the Toppy */
+    oldMask = umask(0077);
+    r = bind(lfd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(oldMask);
+    if((r != 0) || (0 != listen(lfd, 16)))
+    {
+        fprintf(stderr, "ERROR: Can not listen on %s: %s\n", path,
+                strerror(errno));
+        close(lfd);
+        return -errno;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = session_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    trace(1, fprintf(stderr, "Serving requests on %s\n", path));
+
+    while(!stopping)
+    {
+        struct timeval timeout = { SESSION_RECV_TIMEOUT, 0 };
+        int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+        if(conn < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "ERROR: Can not accept request: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        if(0 != setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                           sizeof(timeout)))
+        {
+            fprintf(stderr, "ERROR: Can not set request timeout: %s\n",
+                    strerror(errno));
+            close(conn);
+            continue;
+        }
+
+        serve_one(conn, handler);
+        close(conn);
+    }
+
+    trace(1, fprintf(stderr, "Session on %s closing\n", path));
+    close(lfd);
+    unlink(path);
+    return stopping ? 0 : -EIO;
+}
+
+/* Hand a command line to the session daemon on path and wait for it to run.
+ * Returns the result of the command. */
+int session_request(const char *path, int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    struct session_request_head head;
+    struct session_reply reply;
+    struct timespec t0;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SESSION_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { &head, sizeof(head) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[SESSION_FDS] =
+        { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1 };
+    char *blob = NULL;
+    size_t size = 0;
+    int conn = -1;
+    int r;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    r = make_address(path, &addr);
+    if(r < 0)
+    {
+        return r;
+    }
+
+    if((argc <= 0) || (argc > SESSION_MAX_ARGS))
+    {
+        fprintf(stderr, "ERROR: Too many arguments for a session request\n");
+        return -E2BIG;
+    }
+
+    for(i = 0; i < argc; i++)
+    {
+        size += strlen(argv[i]) + 1;
+    }
+    if(size > SESSION_MAX_REQUEST)
+    {
+        fprintf(stderr, "ERROR: Command line too long for a session request\n");
+        return -E2BIG;
+    }
+
+    blob = malloc(size);
+    if(blob == NULL)
+    {
+        return -ENOMEM;
+    }
+    for(i = 0, size = 0; i < argc; i++)
+    {
+        strcpy(&blob[size], argv[i]);
+        size += strlen(argv[i]) + 1;
+    }
+
+    fds[3] = open(".", O_RDONLY | O_DIRECTORY);
+    if(fds[3] < 0)
+    {
+        fprintf(stderr, "ERROR: Can not open working directory: %s\n",
+                strerror(errno));
+        r = -errno;
+        goto out;
+    }
+
+    conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if((conn < 0) ||
+       (0 != connect(conn, (struct sockaddr *) &addr, sizeof(addr))))
+    {
+        fprintf(stderr, "ERROR: Can not connect to session %s: %s\n", path,
+                strerror(errno));
+        r = -errno;
+        goto out;
+    }
+
+    head.argc = argc;
+    head.size = size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    /* Anything buffered must come out before the daemon starts writing */
+    fflush(stdout);
+    fflush(stderr);
+
+    if((sizeof(head) != sendmsg(conn, &msg, 0)) ||
+       (0 != write_all(conn, blob, size)) ||
+       (0 != read_all(conn, &reply, sizeof(reply))))
+    {
+        fprintf(stderr, "ERROR: Session request failed: %s\n",
+                strerror(errno));
+        r = -EPROTO;
+        goto out;
+    }
+
+    trace(1, fprintf(stderr, "Request ran in %.3f ms, %.3f ms overall\n",
+                     reply.micros / 1000.0, elapsed_micros(&t0) / 1000.0));
+    r = reply.result;
+
+  out:
+    if(conn >= 0)
+    {
+        close(conn);
+    }
+    if(fds[3] >= 0)
+    {
+        close(fds[3]);
+    }
+    free(blob);
+    return r;
+}
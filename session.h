@@ -0,0 +1,60 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _SESSION_H
+#define _SESSION_H 1
+
+#include <asm/types.h>
+
+/* A session daemon holds the Toppy open and runs commands on behalf of thin
+ * clients that connect over a Unix socket. A client sends its command line
+ * together with its stdio and working directory, so the command behaves as
+ * if it had been run by the client itself. Requests are run one
+ * at a time, in the order they are accepted.
+ */
+
+/* Largest command line, in bytes, that a client may send. */
+#define SESSION_MAX_REQUEST 0x10000
+#define SESSION_MAX_ARGS 256
+
+struct session_request_head
+{
+    __u32 argc;
+    __u32 size;                 /* bytes of NUL terminated arguments */
+};
+
+struct session_reply
+{
+    __s32 result;
+    __u32 micros;               /* time taken to run the request */
+};
+
+/* Runs one request, with stdio and the working directory already switched
+ * over to the client's. Returns the command's result. */
+typedef int (*session_handler) (int argc, char *argv[]);
+
+int session_serve(const char *path, session_handler handler);
+int session_request(const char *path, int argc, char *argv[]);
+
+#endif /* _SESSION_H */
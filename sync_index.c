@@ -0,0 +1,364 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sync_index.h"
+#include "usb_io.h"
+
+__u64 sync_hash(const char *path)
+{
+    __u64 h = 0xcbf29ce484222325ULL;
+
+    while(*path)
+    {
+        h ^= (__u8) *path++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+    const struct sync_record *ra = a;
+    const struct sync_record *rb = b;
+
+    return (ra->pathHash > rb->pathHash) - (ra->pathHash < rb->pathHash);
+}
+
+struct tagged_record
+{
+    struct sync_record record;
+    size_t seq;
+};
+
+static int tagged_cmp(const void *a, const void *b)
+{
+    const struct tagged_record *ta = a;
+    const struct tagged_record *tb = b;
+    int r = record_cmp(&ta->record, &tb->record);
+
+    return r ? r : ((ta->seq > tb->seq) - (ta->seq < tb->seq));
+}
+
+static const struct sync_record *find_record(const struct sync_record *r,
+                                             size_t count, __u64 pathHash)
+{
+    struct sync_record key;
+
+    key.pathHash = pathHash;
+    return bsearch(&key, r, count, sizeof(*r), record_cmp);
+}
+
+/* Map the index at path. A missing index is an empty one; an unreadable or
+ * damaged one is reported and then treated as empty, so that the next
+ * commit replaces it. */
+int sync_index_open(struct sync_index *index, const char *path)
+{
+    const struct sync_index_head *head;
+    struct stat64 st;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+    index->path = strdup(path);
+    if(index->path == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    fd = open64(path, O_RDONLY);
+    if(fd < 0)
+    {
+        if(errno == ENOENT)
+        {
+            trace(1, fprintf(stderr, "Starting a new index %s\n", path));
+            return 0;
+        }
+        fprintf(stderr, "ERROR: Can not open index %s: %s\n", path,
+                strerror(errno));
+        return -errno;
+    }
+
+    if((0 != fstat64(fd, &st)) || (st.st_size < (off64_t) sizeof(*head)) ||
+       ((__u64) st.st_size != (size_t) st.st_size))
+    {
+        fprintf(stderr, "WARNING: Ignoring damaged index %s\n", path);
+        close(fd);
+        return 0;
+    }
+
+    index->mapSize = st.st_size;
+    index->map = mmap(NULL, index->mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(index->map == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Can not map index %s: %s\n", path,
+                strerror(errno));
+        index->map = NULL;
+        return -errno;
+    }
+
+    head = index->map;
+    if((head->magic != SYNC_INDEX_MAGIC) ||
+       (head->version != SYNC_INDEX_VERSION) ||
+       (head->count != (index->mapSize - sizeof(*head)) /
+        sizeof(struct sync_record)))
+    {
+        fprintf(stderr, "WARNING: Ignoring damaged index %s\n", path);
+        return 0;
+    }
+
+    index->records = (const struct sync_record *) (head + 1);
+    index->count = head->count;
+    trace(1, fprintf(stderr, "Index %s holds %lu files\n", path,
+                     (unsigned long) index->count));
+    return 0;
+}
+
+/* Returns 1 if path was archived with exactly this size and stamp. */
+int sync_index_match(const struct sync_index *index, const char *path,
+                     __u64 size, __u64 stamp)
+{
+    __u64 pathHash = sync_hash(path);
+    const struct sync_record *r;
+    size_t i;
+
+    /* Additions are few, and a later one wins */
+    for(i = index->addedCount; i > 0; i--)
+    {
+        if(index->added[i - 1].pathHash == pathHash)
+        {
+            r = &index->added[i - 1];
+            return (r->size == size) && (r->stamp == stamp);
+        }
+    }
+
+    r = find_record(index->records, index->count, pathHash);
+    return (r != NULL) && (r->size == size) && (r->stamp == stamp);
+}
+
+int sync_index_add(struct sync_index *index, const char *path, __u64 size,
+                   __u64 stamp)
+{
+    struct sync_record *r;
+
+    if(index->addedCount == index->addedSize)
+    {
+        size_t newSize = index->addedSize ? (index->addedSize * 2) : 64;
+        struct sync_record *added =
+            realloc(index->added, newSize * sizeof(*added));
+
+        if(added == NULL)
+        {
+            return -ENOMEM;
+        }
+        index->added = added;
+        index->addedSize = newSize;
+    }
+
+    r = &index->added[index->addedCount++];
+    r->pathHash = sync_hash(path);
+    r->size = size;
+    r->stamp = stamp;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const __u8 *p = buf;
+
+    while(len > 0)
+    {
+        ssize_t w = write(fd, p, len);
+
+        if(w < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* Merge this run's additions into the index on disk. The merged index is
+ * written next to the old one, synced and renamed over it. */
+int sync_index_commit(struct sync_index *index)
+{
+    struct sync_index_head head;
+    struct sync_record *merged;
+    struct tagged_record *tagged;
+    size_t added = 0;
+    size_t count = 0;
+    size_t i;
+    size_t j;
+    char *tmpPath;
+    int fd;
+    int r;
+
+    if(index->addedCount == 0)
+    {
+        return 0;
+    }
+
+    /* Sort the additions, keeping only the last for each path. qsort is
+       not stable, so tag each with its position first. */
+    tagged = malloc(index->addedCount * sizeof(*tagged));
+    if(tagged == NULL)
+    {
+        return -ENOMEM;
+    }
+    for(i = 0; i < index->addedCount; i++)
+    {
+        tagged[i].record = index->added[i];
+        tagged[i].seq = i;
+    }
+    qsort(tagged, index->addedCount, sizeof(*tagged), tagged_cmp);
+    for(i = 0; i < index->addedCount; i++)
+    {
+        if((i + 1 < index->addedCount) &&
+           (tagged[i + 1].record.pathHash == tagged[i].record.pathHash))
+        {
+            continue;
+        }
+        index->added[added++] = tagged[i].record;
+    }
+    free(tagged);
+
+    merged = malloc((index->count + added) * sizeof(*merged));
+    if(merged == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    for(i = 0, j = 0; (i < index->count) || (j < added);)
+    {
+        if((j == added) || ((i < index->count) &&
+                            (index->records[i].pathHash <
+                             index->added[j].pathHash)))
+        {
+            merged[count++] = index->records[i++];
+        }
+        else
+        {
+            if((i < index->count) &&
+               (index->records[i].pathHash == index->added[j].pathHash))
+            {
+                i++;
+            }
+            merged[count++] = index->added[j++];
+        }
+    }
+
+    tmpPath = malloc(strlen(index->path) + 5);
+    if(tmpPath == NULL)
+    {
+        free(merged);
+        return -ENOMEM;
+    }
+    sprintf(tmpPath, "%s.tmp", index->path);
+
+    head.magic = SYNC_INDEX_MAGIC;
+    head.version = SYNC_INDEX_VERSION;
+    head.count = count;
+
+    fd = open64(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0)
+    {
+        r = -errno;
+    }
+    else
+    {
+        r = write_all(fd, &head, sizeof(head));
+        if(r == 0)
+        {
+            r = write_all(fd, merged, count * sizeof(*merged));
+        }
+        if((r == 0) && (0 != fsync(fd)))
+        {
+            r = -errno;
+        }
+        if((0 != close(fd)) && (r == 0))
+        {
+            r = -errno;
+        }
+        if((r == 0) && (0 != rename(tmpPath, index->path)))
+        {
+            r = -errno;
+        }
+        if(r != 0)
+        {
+            unlink(tmpPath);
+        }
+    }
+
+    if(r != 0)
+    {
+        fprintf(stderr, "ERROR: Can not update index %s: %s\n", index->path,
+                strerror(-r));
+    }
+    else
+    {
+        trace(1, fprintf(stderr, "Index %s now holds %lu files\n",
+                         index->path, (unsigned long) count));
+
+        /* Carry on from the merged records, so that a run can commit more
+           than once. */
+        free(index->merged);
+        index->merged = merged;
+        index->records = merged;
+        index->count = count;
+        index->addedCount = 0;
+        merged = NULL;
+    }
+
+    free(tmpPath);
+    free(merged);
+    return r;
+}
+
+void sync_index_close(struct sync_index *index)
+{
+    if(index->map != NULL)
+    {
+        munmap(index->map, index->mapSize);
+    }
+    free(index->merged);
+    free(index->added);
+    free(index->path);
+    memset(index, 0, sizeof(*index));
+}
@@ -0,0 +1,87 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _SYNC_INDEX_H
+#define _SYNC_INDEX_H 1
+
+#include <stddef.h>
+#include <asm/types.h>
+
+/* The sync index remembers which remote files have already been archived.
+ *
+ * On disk it is a small header followed by fixed size records sorted by the
+ * hash of the remote path, in host byte order. The file is mapped and
+ * searched in place, so even a large catalogue costs nothing to load. Files
+ * archived during a run are collected in memory and merged in by
+ * sync_index_commit(), which writes a new file and renames it over the old
+ * one, so the index on disk is always complete.
+ *
+ * Paths are identified by a 64 bit FNV-1a hash alone. For the tens of
+ * thousands of files on a Toppy the chance of a collision is negligible.
+ */
+
+#define SYNC_INDEX_MAGIC 0x58444950    /* "PIDX" */
+#define SYNC_INDEX_VERSION 1
+
+struct sync_index_head
+{
+    __u32 magic;
+    __u32 version;
+    __u64 count;
+};
+
+struct sync_record
+{
+    __u64 pathHash;
+    __u64 size;
+    __u64 stamp;                /* MJD << 24 | hour << 16 | minute << 8 | second */
+};
+
+struct sync_index
+{
+    char *path;
+
+    /* The committed index, mapped or as merged by the last commit */
+    const struct sync_record *records;
+    size_t count;
+    void *map;
+    size_t mapSize;
+    struct sync_record *merged;
+
+    /* Additions from this run, not yet committed */
+    struct sync_record *added;
+    size_t addedCount;
+    size_t addedSize;
+};
+
+__u64 sync_hash(const char *path);
+int sync_index_open(struct sync_index *index, const char *path);
+int sync_index_match(const struct sync_index *index, const char *path,
+                     __u64 size, __u64 stamp);
+int sync_index_add(struct sync_index *index, const char *path, __u64 size,
+                   __u64 stamp);
+int sync_index_commit(struct sync_index *index);
+void sync_index_close(struct sync_index *index);
+
+#endif /* _SYNC_INDEX_H */
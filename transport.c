@@ -0,0 +1,201 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "transport.h"
+#include "usb_io.h"
+
+/* File descriptors bound to something other than usbfs. A binding is made
+ * before the descriptor is used and removed before it is closed, by the
+ * thread that owns it, so lookups need no lock. */
+static const struct transport *bound[TRANSPORT_MAX_FD];
+
+int transport_attach(int fd, const struct transport *t)
+{
+    if((fd < 0) || (fd >= TRANSPORT_MAX_FD))
+    {
+        return -EMFILE;
+    }
+
+    bound[fd] = t;
+    return 0;
+}
+
+void transport_detach(int fd)
+{
+    if((fd >= 0) && (fd < TRANSPORT_MAX_FD))
+    {
+        bound[fd] = NULL;
+    }
+}
+
+/* The transport bound to fd, or NULL for a usbfs device. */
+const struct transport *transport_get(int fd)
+{
+    if((fd < 0) || (fd >= TRANSPORT_MAX_FD))
+    {
+        return NULL;
+    }
+
+    return bound[fd];
+}
+
+/* Wait up to timeout milliseconds for fd to become ready for events. */
+static int socket_wait(int fd, short events, int timeout)
+{
+    struct pollfd pfd;
+    int r;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do
+    {
+        r = poll(&pfd, 1, (timeout > 0) ? timeout : -1);
+    }
+    while((r < 0) && (errno == EINTR));
+
+    if(r == 0)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return (r < 0) ? -1 : 0;
+}
+
+static ssize_t socket_bulk_read(int fd, int ep, __u8 * bytes, ssize_t size,
+                                int timeout)
+{
+    ssize_t r;
+
+    trace(3, fprintf(stderr, "%s: requesting %d bytes from ep 0x%x\n",
+                     __func__, (int) size, ep));
+
+    if(0 != socket_wait(fd, POLLIN, timeout))
+    {
+        return -1;
+    }
+
+    do
+    {
+        r = recv(fd, bytes, size, MSG_TRUNC);
+    }
+    while((r < 0) && (errno == EINTR));
+
+    if(r == 0)
+    {
+        /* The other end has gone away */
+        errno = EPIPE;
+        return -1;
+    }
+    if(r > size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    trace(3, fprintf(stderr, "%s: returning %d bytes\n", __func__, (int) r));
+    return r;
+}
+
+static ssize_t socket_bulk_write(int fd, int ep, const __u8 * bytes,
+                                 ssize_t length, int timeout)
+{
+    ssize_t r;
+
+    trace(3, fprintf(stderr, "%s: sending %d bytes to ep 0x%x\n", __func__,
+                     (int) length, ep));
+
+    if(0 != socket_wait(fd, POLLOUT, timeout))
+    {
+        return -1;
+    }
+
+    do
+    {
+        r = send(fd, bytes, length, MSG_NOSIGNAL);
+    }
+    while((r < 0) && (errno == EINTR));
+
+    return r;
+}
+
+const struct transport socket_transport = {
+    "socket",
+    socket_bulk_read,
+    socket_bulk_write
+};
+
+int transport_is_path(const char *path)
+{
+    return 0 == strncmp(path, TRANSPORT_UNIX_PREFIX,
+                        strlen(TRANSPORT_UNIX_PREFIX));
+}
+
+/* Connect to the emulator named by a unix:PATH device path and bind the
+ * socket transport to the connection. Returns the file descriptor, or a
+ * negative errno. */
+int transport_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    const char *sockPath = path + strlen(TRANSPORT_UNIX_PREFIX);
+    int fd;
+    int r;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(sockPath) >= sizeof(addr.sun_path))
+    {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, sockPath);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(fd < 0)
+    {
+        return -errno;
+    }
+
+    if(0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+    {
+        r = -errno;
+        close(fd);
+        return r;
+    }
+
+    r = transport_attach(fd, &socket_transport);
+    if(r != 0)
+    {
+        close(fd);
+        return r;
+    }
+
+    trace(1, fprintf(stderr, "Connected to %s\n", path));
+    return fd;
+}
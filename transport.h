@@ -0,0 +1,66 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H 1
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+/* A transport carries bulk transfers between puppy and a Toppy. Normally
+ * that is a usbfs device node, driven with USBDEVFS_BULK. A file descriptor
+ * can instead be bound to another transport, which usb_bulk_read() and
+ * usb_bulk_write() then hand the transfers to.
+ *
+ * The socket transport talks to a device emulator over a Unix socket of
+ * type SOCK_SEQPACKET. Each bulk transfer is one message, so a message
+ * boundary stands in for the short USB packet that ends a transfer.
+ */
+
+struct transport
+{
+    const char *name;
+    ssize_t (*bulk_read) (int fd, int ep, __u8 * bytes, ssize_t size,
+                          int timeout);
+    ssize_t (*bulk_write) (int fd, int ep, const __u8 * bytes,
+                           ssize_t length, int timeout);
+};
+
+extern const struct transport socket_transport;
+
+/* Device paths of this form name an emulator socket rather than a usbfs
+   device node */
+#define TRANSPORT_UNIX_PREFIX "unix:"
+
+/* Highest file descriptor that can be bound to a transport */
+#define TRANSPORT_MAX_FD 1024
+
+int transport_attach(int fd, const struct transport *t);
+void transport_detach(int fd);
+const struct transport *transport_get(int fd);
+
+int transport_is_path(const char *path);
+int transport_connect(const char *path);
+
+#endif /* _TRANSPORT_H */
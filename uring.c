@@ -0,0 +1,295 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include <errno.h>
+#include <string.h>
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* There is no liburing on most of our targets, so talk to the kernel
+ * directly. The rings are shared with the kernel; the head and tail
+ * indices are published with acquire/release ordering.
+ */
+
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                   NULL, 0);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, offset);
+}
+
+int uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+
+    u->fd = sys_io_uring_setup(entries, &p);
+    if(u->fd < 0)
+    {
+        return -errno;
+    }
+
+    u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(__u32);
+    u->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sqRing = map_ring(u->fd, u->sqRingSize, IORING_OFF_SQ_RING);
+    if(u->sqRing == MAP_FAILED)
+    {
+        goto fail;
+    }
+
+    u->cqRing = map_ring(u->fd, u->cqRingSize, IORING_OFF_CQ_RING);
+    if(u->cqRing == MAP_FAILED)
+    {
+        goto fail;
+    }
+
+    u->sqes = map_ring(u->fd, u->sqesSize, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED)
+    {
+        goto fail;
+    }
+
+    u->sqHead = (unsigned *) ((char *) u->sqRing + p.sq_off.head);
+    u->sqTail = (unsigned *) ((char *) u->sqRing + p.sq_off.tail);
+    u->sqMask = (unsigned *) ((char *) u->sqRing + p.sq_off.ring_mask);
+    u->sqArray = (unsigned *) ((char *) u->sqRing + p.sq_off.array);
+    u->sqEntries = p.sq_entries;
+    u->sqLocalTail = *u->sqTail;
+
+    u->cqHead = (unsigned *) ((char *) u->cqRing + p.cq_off.head);
+    u->cqTail = (unsigned *) ((char *) u->cqRing + p.cq_off.tail);
+    u->cqMask = (unsigned *) ((char *) u->cqRing + p.cq_off.ring_mask);
+    u->cqes = (char *) u->cqRing + p.cq_off.cqes;
+
+    return 0;
+
+  fail:
+    err = errno;
+    uring_exit(u);
+    return -err;
+}
+
+void uring_exit(struct uring *u)
+{
+    if((u->sqes != NULL) && (u->sqes != MAP_FAILED))
+    {
+        munmap(u->sqes, u->sqesSize);
+    }
+    if((u->cqRing != NULL) && (u->cqRing != MAP_FAILED))
+    {
+        munmap(u->cqRing, u->cqRingSize);
+    }
+    if((u->sqRing != NULL) && (u->sqRing != MAP_FAILED))
+    {
+        munmap(u->sqRing, u->sqRingSize);
+    }
+    if(u->fd >= 0)
+    {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+int uring_queue_writev(struct uring *u, int fd, const struct iovec *iov,
+                       __u64 offset, __u64 userData, int link)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if(u->sqLocalTail - load_acquire(u->sqHead) >= u->sqEntries)
+    {
+        return -EBUSY;
+    }
+
+    index = u->sqLocalTail & *u->sqMask;
+    sqe = (struct io_uring_sqe *) u->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (unsigned long) iov;
+    sqe->len = 1;
+    sqe->user_data = userData;
+    if(link)
+    {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+
+    u->sqArray[index] = index;
+    u->sqLocalTail++;
+    return 0;
+}
+
+int uring_submit(struct uring *u, unsigned waitNr)
+{
+    /* Count from the kernel's head rather than the published tail, so that
+       entries a previous call left unconsumed are submitted again. */
+    unsigned toSubmit = u->sqLocalTail - load_acquire(u->sqHead);
+    int r;
+
+    store_release(u->sqTail, u->sqLocalTail);
+
+    do
+    {
+        r = sys_io_uring_enter(u->fd, toSubmit, waitNr,
+                               waitNr ? IORING_ENTER_GETEVENTS : 0);
+    }
+    while((r < 0) && (errno == EINTR));
+
+    return (r < 0) ? -errno : r;
+}
+
+/* Take back writes that were handed to the kernel by a failed
+ * uring_submit() but never consumed by it. The ring is not set up with
+ * SQPOLL, so the kernel only consumes entries inside io_uring_enter() and
+ * the tail can safely be moved back. Fills in the user data of up to max
+ * of them and returns how many were taken back.
+ */
+unsigned uring_unqueue(struct uring *u, __u64 *userData, unsigned max)
+{
+    unsigned head;
+    unsigned n;
+    unsigned i;
+
+    if(u->fd < 0)
+    {
+        return 0;
+    }
+
+    head = load_acquire(u->sqHead);
+    n = u->sqLocalTail - head;
+
+    for(i = 0; (i < n) && (i < max); i++)
+    {
+        unsigned index = u->sqArray[(head + i) & *u->sqMask];
+
+        userData[i] = ((struct io_uring_sqe *) u->sqes)[index].user_data;
+    }
+
+    u->sqLocalTail = head;
+    store_release(u->sqTail, head);
+    return n;
+}
+
+int uring_reap(struct uring *u, __u64 *userData, int *res)
+{
+    unsigned head;
+    struct io_uring_cqe *cqe;
+
+    /* Nothing completes on a ring that has been torn down */
+    if(u->fd < 0)
+    {
+        return 0;
+    }
+
+    head = *u->cqHead;
+    if(head == load_acquire(u->cqTail))
+    {
+        return 0;
+    }
+
+    cqe = (struct io_uring_cqe *) u->cqes + (head & *u->cqMask);
+    *userData = cqe->user_data;
+    *res = cqe->res;
+    store_release(u->cqHead, head + 1);
+    return 1;
+}
+
+#else /* !HAVE_IO_URING */
+
+int uring_init(struct uring *u, unsigned entries)
+{
+    (void) entries;
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+    return -ENOSYS;
+}
+
+void uring_exit(struct uring *u)
+{
+    (void) u;
+}
+
+int uring_queue_writev(struct uring *u, int fd, const struct iovec *iov,
+                       __u64 offset, __u64 userData, int link)
+{
+    (void) u;
+    (void) fd;
+    (void) iov;
+    (void) offset;
+    (void) userData;
+    (void) link;
+    return -ENOSYS;
+}
+
+int uring_submit(struct uring *u, unsigned waitNr)
+{
+    (void) u;
+    (void) waitNr;
+    return -ENOSYS;
+}
+
+unsigned uring_unqueue(struct uring *u, __u64 *userData, unsigned max)
+{
+    (void) u;
+    (void) userData;
+    (void) max;
+    return 0;
+}
+
+int uring_reap(struct uring *u, __u64 *userData, int *res)
+{
+    (void) u;
+    (void) userData;
+    (void) res;
+    return 0;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,76 @@
+/* $Id$ */
+
+/*
+
+  Copyright (C) 2004-2008 Peter Urbanec <toppy at urbanec.net>
+
+  This file is part of puppy.
+
+  puppy is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  puppy is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with puppy; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef _URING_H
+#define _URING_H 1
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <asm/types.h>
+
+/* A minimal io_uring binding, just enough to queue file writes.
+ * Built only when HAVE_IO_URING is defined; otherwise uring_init() fails
+ * with -ENOSYS and callers use plain write().
+ */
+struct uring
+{
+    int fd;
+
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    void *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail;       /* queued but not yet submitted */
+
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    void *cqes;
+};
+
+int uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+
+/* Queue a write of iov at offset. link chains it to the next write. */
+int uring_queue_writev(struct uring *u, int fd, const struct iovec *iov,
+                       __u64 offset, __u64 userData, int link);
+
+/* Submit queued writes and wait for at least waitNr completions. */
+int uring_submit(struct uring *u, unsigned waitNr);
+
+/* After a failed submit, take back the writes the kernel never saw. */
+unsigned uring_unqueue(struct uring *u, __u64 *userData, unsigned max);
+
+/* Fetch one completion. Returns 0 if none are ready. */
+int uring_reap(struct uring *u, __u64 *userData, int *res);
+
+#endif /* _URING_H */
@@ -25,16 +25,21 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <poll.h>
 #include <asm/byteorder.h>
 #include "usb_io.h"
 #include "tf_bytes.h"
 #include "crc16.h"
+#include "byte_swap.h"
+#include "transport.h"
 
 /* The Topfield packet handling is a bit unusual. All data is stored in
  * memory in big endian order, however, just prior to transmission all
@@ -55,21 +60,60 @@
 int packet_trace = 0;
 int verbose = 0;
 int ignore_crc = 0;
+__thread int defer_crc = 0;
 
-/* Swap the odd and even bytes in the buffer, up to count bytes.
- * If count is odd, the last byte remains unafected.
- */
-void byte_swap(__u8 * d, int count)
+/* Settings installed by this thread, or NULL to use the globals above */
+__thread struct usb_io_settings *io_settings = NULL;
+
+/* Install settings for this thread. Returns the ones they replace, so
+   that they can be put back. */
+struct usb_io_settings *usb_io_use(struct usb_io_settings *s)
 {
-    int i;
+    struct usb_io_settings *old = io_settings;
 
-    for(i = 0; i < (count & ~1); i += 2)
-    {
-        __u8 t = d[i];
+    io_settings = s;
+    return old;
+}
+
+static int packet_tracing(void)
+{
+    return (io_settings != NULL) ? io_settings->packetTrace : packet_trace;
+}
+
+/* Report a protocol or transfer failure. Without settings the message is
+ * printed. With them, only the first failure is kept, as err and the
+ * message without its severity prefix or newline. */
+static void io_error(int err, const char *fmt, ...)
+{
+    va_list ap;
+    char *text;
+    size_t len;
 
-        d[i] = d[i + 1];
-        d[i + 1] = t;
+    va_start(ap, fmt);
+    if(io_settings == NULL)
+    {
+        vfprintf(stderr, fmt, ap);
+    }
+    else if(io_settings->error == 0)
+    {
+        io_settings->error = err;
+        text = io_settings->errorText;
+        vsnprintf(text, sizeof(io_settings->errorText), fmt, ap);
+        if(0 == strncmp(text, "ERROR: ", 7))
+        {
+            memmove(text, text + 7, strlen(text + 7) + 1);
+        }
+        else if(0 == strncmp(text, "WARNING: ", 9))
+        {
+            memmove(text, text + 9, strlen(text + 9) + 1);
+        }
+        len = strlen(text);
+        if((len > 0) && (text[len - 1] == '\n'))
+        {
+            text[len - 1] = '\0';
+        }
     }
+    va_end(ap);
 }
 
 /* Byte swap an incoming packet. */
@@ -93,6 +137,74 @@ void swap_out_packet(struct tf_packet *packet)
     byte_swap((__u8 *) packet, size);
 }
 
+/* The fused routines below byte swap a packet and calculate its CRC in a
+ * single pass. The packet is walked in blocks small enough to stay in the
+ * L1 cache, so each block is swapped and then checksummed while it is
+ * still hot instead of pulling the whole packet through the cache twice.
+ */
+#define SWAP_CRC_BLOCK 4096
+
+/* Byte swap an incoming packet and return the CRC of its contents. */
+__u16 swap_in_packet_crc(struct tf_packet *packet)
+{
+    __u8 *d = (__u8 *) packet;
+    int crcEnd = get_u16_raw(packet);
+    int size = (crcEnd + 1) & ~1;
+    int pos;
+    __u16 crc = 0;
+
+    if(size > MAXIMUM_PACKET_SIZE)
+    {
+        size = MAXIMUM_PACKET_SIZE;
+    };
+
+    for(pos = 0; pos < size; pos += SWAP_CRC_BLOCK)
+    {
+        int end = MIN(pos + SWAP_CRC_BLOCK, size);
+        int from = (pos < 4) ? 4 : pos;
+        int to = MIN(end, crcEnd);
+
+        byte_swap(d + pos, end - pos);
+        if(to > from)
+        {
+            crc = crc16_ansi_update(crc, d + from, to - from);
+        }
+    }
+
+    return crc;
+}
+
+/* Calculate and fill in the CRC of an outgoing packet, byte swapping it
+ * for transmission in the same pass. */
+void crc_swap_out_packet(struct tf_packet *packet)
+{
+    __u8 *d = (__u8 *) packet;
+    int crcEnd = get_u16(&packet->length);
+    int size = (crcEnd + 1) & ~1;
+    int pos;
+    __u16 crc = 0;
+
+    if(size > MAXIMUM_PACKET_SIZE)
+    {
+        size = MAXIMUM_PACKET_SIZE;
+    };
+
+    for(pos = 4; pos < size; pos += SWAP_CRC_BLOCK)
+    {
+        int end = MIN(pos + SWAP_CRC_BLOCK, size);
+        int to = MIN(end, crcEnd);
+
+        if(to > pos)
+        {
+            crc = crc16_ansi_update(crc, d + pos, to - pos);
+        }
+        byte_swap(d + pos, end - pos);
+    }
+
+    put_u16(&packet->crc, crc);
+    byte_swap(d, 4);
+}
+
 static __u8 cancel_packet[8] = {
     0x08, 0x00, 0x40, 0x01, 0x00, 0x00, 0x03, 0x00
 };
@@ -176,7 +288,7 @@ ssize_t send_cmd_hdd_dir(const int fd, const char *path)
 
     if((PACKET_HEAD_SIZE + pathLen) >= MAXIMUM_PACKET_SIZE)
     {
-        fprintf(stderr, "ERROR: Path is too long.\n");
+        io_error(-ENAMETOOLONG, "ERROR: Path is too long.\n");
         return -1;
     }
 
@@ -198,7 +310,7 @@ ssize_t send_cmd_hdd_file_send(const int fd, __u8 dir, const char *path)
 
     if((PACKET_HEAD_SIZE + 1 + 2 + pathLen) >= MAXIMUM_PACKET_SIZE)
     {
-        fprintf(stderr, "ERROR: Path is too long.\n");
+        io_error(-ENAMETOOLONG, "ERROR: Path is too long.\n");
         return -1;
     }
 
@@ -212,6 +324,36 @@ ssize_t send_cmd_hdd_file_send(const int fd, __u8 dir, const char *path)
     return send_tf_packet(fd, &req);
 }
 
+/* As send_cmd_hdd_file_send, but ask for the transfer to start at offset.
+ * Firmware that does not know about the offset ignores it and starts from
+ * the beginning, so callers must check the offset of the first data packet.
+ */
+ssize_t send_cmd_hdd_file_send_with_offset(const int fd, __u8 dir,
+                                           const char *path, __u64 offset)
+{
+    struct tf_packet req;
+    __u16 packetSize;
+    int pathLen = strlen(path) + 1;
+
+    trace(2, fprintf(stderr, "%s\n", __func__));
+
+    if((PACKET_HEAD_SIZE + 1 + 2 + pathLen + 8) >= MAXIMUM_PACKET_SIZE)
+    {
+        io_error(-ENAMETOOLONG, "ERROR: Path is too long.\n");
+        return -1;
+    }
+
+    packetSize = PACKET_HEAD_SIZE + 1 + 2 + pathLen + 8;
+    packetSize = (packetSize + 1) & ~1;
+    put_u16(&req.length, packetSize);
+    put_u32(&req.cmd, CMD_HDD_FILE_SEND);
+    req.data[0] = dir;
+    put_u16(&req.data[1], pathLen);
+    strcpy((char *) &req.data[3], path);
+    put_u64(&req.data[3 + pathLen], offset);
+    return send_tf_packet(fd, &req);
+}
+
 ssize_t send_cmd_hdd_del(const int fd, const char *path)
 {
     struct tf_packet req;
@@ -222,7 +364,7 @@ ssize_t send_cmd_hdd_del(const int fd, const char *path)
 
     if((PACKET_HEAD_SIZE + pathLen) >= MAXIMUM_PACKET_SIZE)
     {
-        fprintf(stderr, "ERROR: Path is too long.\n");
+        io_error(-ENAMETOOLONG, "ERROR: Path is too long.\n");
         return -1;
     }
 
@@ -245,8 +387,8 @@ ssize_t send_cmd_hdd_rename(const int fd, const char *src, const char *dst)
 
     if((PACKET_HEAD_SIZE + 2 + srcLen + 2 + dstLen) >= MAXIMUM_PACKET_SIZE)
     {
-        fprintf(stderr,
-                "ERROR: Combination of source and destination paths is too long.\n");
+        io_error(-ENAMETOOLONG,
+                 "ERROR: Combination of source and destination paths is too long.\n");
         return -1;
     }
 
@@ -271,7 +413,7 @@ ssize_t send_cmd_hdd_create_dir(const int fd, const char *path)
 
     if((PACKET_HEAD_SIZE + 2 + pathLen) >= MAXIMUM_PACKET_SIZE)
     {
-        fprintf(stderr, "ERROR: Path is too long.\n");
+        io_error(-ENAMETOOLONG, "ERROR: Path is too long.\n");
         return -1;
     }
 
@@ -290,7 +432,7 @@ void print_packet(const struct tf_packet *packet, const char *prefix)
     __u8 *d = (__u8 *) packet;
     __u16 pl = get_u16(&packet->length);
 
-    switch (packet_trace)
+    switch (packet_tracing())
     {
         case 0:
             /* Do nothing */
@@ -330,28 +472,115 @@ void print_packet(const struct tf_packet *packet, const char *prefix)
     }
 }
 
-/* Given a Topfield protocol packet, this function will calculate the required
- * CRC and send the packet out over a bulk pipe. */
-ssize_t send_tf_packet(int fd, struct tf_packet *packet)
+/* Calculate the CRC of a Topfield protocol packet and put it into wire byte
+ * order, ready for send_prepared_tf_packet. This is the CPU heavy half of
+ * sending, so callers can do it while the device is busy with the previous
+ * packet. The packet must not be changed after this. */
+void prepare_tf_packet(struct tf_packet *packet)
+{
+    /* Packet tracing wants to see the CRC before the packet is swapped. */
+    if(packet_tracing())
+    {
+        put_u16(&packet->crc, get_crc(packet));
+        print_packet(packet, "OUT>");
+        swap_out_packet(packet);
+    }
+    else
+    {
+        crc_swap_out_packet(packet);
+    }
+}
+
+/* Send a packet that has been through prepare_tf_packet out over a bulk
+ * pipe. */
+ssize_t send_prepared_tf_packet(int fd, struct tf_packet *packet)
 {
-    unsigned int pl = get_u16(&packet->length);
-    ssize_t byte_count = (pl + 1) & ~1;
+    ssize_t byte_count = (get_u16_raw(packet) + 1) & ~1;
 
     trace(3, fprintf(stderr, "%s\n", __func__));
-    put_u16(&packet->crc, get_crc(packet));
-    print_packet(packet, "OUT>");
-    swap_out_packet(packet);
+
     return usb_bulk_write(fd, 0x01, (__u8 *) packet, byte_count,
                           TF_PROTOCOL_TIMEOUT);
 }
 
+/* Given a Topfield protocol packet, this function will calculate the required
+ * CRC and send the packet out over a bulk pipe. */
+ssize_t send_tf_packet(int fd, struct tf_packet *packet)
+{
+    trace(3, fprintf(stderr, "%s\n", __func__));
+
+    prepare_tf_packet(packet);
+    return send_prepared_tf_packet(fd, packet);
+}
+
+/* Validate, acknowledge and byte swap a freshly received packet.
+ * r is the number of bytes that arrived from the device.
+ */
+static ssize_t finish_tf_packet(const int fd, struct tf_packet *packet,
+                                const int r)
+{
+    __u16 len = 0;
+    __u16 calc_crc = 0;
+    int check_crc = !((io_settings != NULL) ? io_settings->ignoreCrc :
+                      ignore_crc);
+
+    if(r < PACKET_HEAD_SIZE)
+    {
+        io_error(-EPROTO, "Short read. %d bytes\n", r);
+        return -1;
+    }
+
+    /* Send SUCCESS as soon as we see a data transfer packet */
+    if(DATA_HDD_FILE_DATA == get_u32_raw(&packet->cmd))
+    {
+        send_success(fd);
+        if(defer_crc)
+        {
+            check_crc = 0;
+        }
+    }
+
+    /* Ignore CRC - support for USB accellerator patch. */
+    if(!check_crc)
+    {
+        swap_in_packet(packet);
+    }
+    else
+    {
+        calc_crc = swap_in_packet_crc(packet);
+    }
+
+    len = get_u16(&packet->length);
+
+    if(len < PACKET_HEAD_SIZE)
+    {
+        io_error(-EPROTO, "Invalid packet length %04x\n", len);
+        return -1;
+    }
+
+    if(check_crc)
+    {
+        __u16 crc;
+        crc = get_u16(&packet->crc);
+
+        /* Complain about CRC mismatch */
+        if(crc != calc_crc)
+        {
+            io_error(-EBADMSG, "WARNING: Packet CRC %04x, expected %04x\n",
+                     crc, calc_crc);
+        }
+    }
+
+    print_packet(packet, " IN<");
+    return r;
+}
+
 /* Receive a Topfield protocol packet.
  * Returns a negative number if the packet read failed for some reason.
  */
 ssize_t get_tf_packet(int fd, struct tf_packet * packet)
 {
     __u8 *buf = (__u8 *) packet;
-    __u16 len = 0;
     int r;
 
     trace(3, fprintf(stderr, "get_tf_packet\n"));
@@ -360,62 +589,382 @@ ssize_t get_tf_packet(int fd, struct tf_packet * packet)
                       TF_PROTOCOL_TIMEOUT);
     if(r < 0)
     {
-        fprintf(stderr, "USB read error: %s\n", strerror(errno));
+        io_error(-errno, "USB read error: %s\n", strerror(errno));
         return -1;
     }
 
-    if(r < PACKET_HEAD_SIZE)
+    return finish_tf_packet(fd, packet, r);
+}
+
+/* Older kernel headers do not know about usbfs capabilities. */
+#ifndef USBDEVFS_GET_CAPABILITIES
+#define USBDEVFS_GET_CAPABILITIES        _IOR('U', 26, __u32)
+#endif
+
+#ifndef USBDEVFS_CAP_BULK_CONTINUATION
+#define USBDEVFS_CAP_BULK_CONTINUATION   0x02
+#endif
+
+#ifndef USBDEVFS_CAP_NO_PACKET_SIZE_LIM
+#define USBDEVFS_CAP_NO_PACKET_SIZE_LIM  0x04
+#endif
+
+#ifndef USBDEVFS_CAP_BULK_SCATTER_GATHER
+#define USBDEVFS_CAP_BULK_SCATTER_GATHER 0x08
+#endif
+
+/* Largest transfer handed to a single usbdevfs request.
+ *
+ * Old kernels limit each request to one page, so 4096 is the most portable
+ * maximum and remains the default. Kernels that report capabilities have at
+ * least the 16 KiB MAX_USBFS_BUFFER_SIZE limit, and kernels that advertise
+ * NO_PACKET_SIZE_LIM take a whole Topfield packet in one go.
+ */
+#define MAX_TRANSFER_LEGACY 4096
+#define MAX_TRANSFER_CAPS   16384
+
+/* Each thread drives its own device */
+static __thread int max_read = MAX_TRANSFER_LEGACY;
+static __thread int max_write = MAX_TRANSFER_LEGACY;
+
+/* Ask usbfs what it can do and size bulk transfers to match.
+ * Returns the capability mask, or 0 if the kernel predates the query.
+ */
+__u32 usb_probe_capabilities(const int fd)
+{
+    __u32 caps = 0;
+    const struct transport *t = transport_get(fd);
+
+    /* Other transports take a whole packet in each transfer */
+    if(t != NULL)
+    {
+        max_read = max_write = sizeof(struct tf_packet);
+        trace(1, fprintf(stderr, "Using the %s transport\n", t->name));
+        return 0;
+    }
+
+    if(0 != ioctl(fd, USBDEVFS_GET_CAPABILITIES, &caps))
+    {
+        trace(2, fprintf(stderr, "USBDEVFS_GET_CAPABILITIES: %s\n",
+                         strerror(errno)));
+        caps = 0;
+        max_read = max_write = MAX_TRANSFER_LEGACY;
+    }
+    else if(caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)
+    {
+        max_read = max_write = sizeof(struct tf_packet);
+    }
+    else
+    {
+        max_read = max_write = MAX_TRANSFER_CAPS;
+    }
+
+    trace(1, fprintf(stderr,
+                     "usbfs capabilities 0x%x%s%s%s: %d byte reads, %d byte writes, "
+                     "%d requests per full packet\n", caps,
+                     (caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM) ?
+                     " NO_PACKET_SIZE_LIM" : "",
+                     (caps & USBDEVFS_CAP_BULK_CONTINUATION) ?
+                     " BULK_CONTINUATION" : "",
+                     (caps & USBDEVFS_CAP_BULK_SCATTER_GATHER) ?
+                     " BULK_SCATTER_GATHER" : "", max_read, max_write,
+                     (int) ((sizeof(struct tf_packet) + max_read - 1) /
+                            max_read)));
+
+    return caps;
+}
+
+/* Asynchronous read queue.
+ *
+ * During a file transfer the Toppy sends one packet, waits for SUCCESS and
+ * then immediately sends the next one. With synchronous reads the next
+ * USBDEVFS_BULK is only issued after the previous packet has been processed
+ * and written to disk, so the bus sits idle in between. Keeping several
+ * URBs queued on the bulk IN endpoint lets the next packet land while the
+ * previous one is still being handled.
+ *
+ * Each URB is large enough for a whole packet. The Toppy never sends
+ * packets that are a multiple of 0x200 bytes, so every packet ends with a
+ * short USB transfer and completes exactly one URB. This needs a kernel
+ * without the usbfs transfer size limit; on older kernels the queue is not
+ * used.
+ *
+ * Where the kernel allows it (Linux 4.6 and later), the URB buffers are
+ * mmap()ed from the usbfs file descriptor. The host controller then DMAs
+ * straight into memory we can see, rather than into a kernel buffer that is
+ * copied out when the URB is reaped.
+ */
+
+struct read_slot
+{
+    struct usbdevfs_urb *urb;
+    struct tf_packet *packet;
+    size_t mapped;
+    int busy;
+};
+
+/* Round a packet buffer up to whole pages, as required by usbfs mmap. */
+static size_t packet_buffer_size(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return (sizeof(struct tf_packet) + page - 1) & ~(page - 1);
+}
+
+/* Allocate a packet buffer for slot, preferring usbfs DMA memory. */
+static int alloc_read_slot(const int fd, struct read_slot *slot)
+{
+    size_t size = packet_buffer_size();
+    void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(buf != MAP_FAILED)
+    {
+        slot->packet = buf;
+        slot->mapped = size;
+        return 0;
+    }
+
+    trace(2, fprintf(stderr, "%s: usbfs mmap failed: %s\n", __func__,
+                     strerror(errno)));
+
+    slot->packet = malloc(sizeof(struct tf_packet));
+    slot->mapped = 0;
+    return (slot->packet == NULL) ? -1 : 0;
+}
+
+static void free_read_slot(struct read_slot *slot)
+{
+    if(slot->mapped)
+    {
+        munmap(slot->packet, slot->mapped);
+    }
+    else
+    {
+        free(slot->packet);
+    }
+    free(slot->urb);
+    slot->packet = NULL;
+    slot->urb = NULL;
+    slot->mapped = 0;
+}
+
+static __thread struct read_slot read_queue[READ_QUEUE_DEPTH];
+static __thread int read_queue_len = 0;
+static __thread int read_queue_ep = 0;
+static __thread struct read_slot *read_held = NULL;
+
+static int submit_read_slot(const int fd, struct read_slot *slot)
+{
+    int r;
+
+    memset(slot->urb, 0, sizeof(struct usbdevfs_urb));
+    slot->urb->type = USBDEVFS_URB_TYPE_BULK;
+    slot->urb->endpoint = read_queue_ep;
+    slot->urb->buffer = slot->packet;
+    slot->urb->buffer_length = sizeof(struct tf_packet);
+    slot->urb->usercontext = slot;
+
+    trace(4, fprintf(stderr, "%s: URB %p, %d bytes\n", __func__,
+                     (void *) slot->urb, slot->urb->buffer_length));
+
+    r = ioctl(fd, USBDEVFS_SUBMITURB, slot->urb);
+    if(r == 0)
+    {
+        slot->busy = 1;
+    }
+    return r;
+}
+
+/* Wait up to timeout milliseconds for the next completed read URB. */
+static struct read_slot *reap_read_slot(const int fd, const int timeout)
+{
+    struct pollfd pfd;
+    struct usbdevfs_urb *urb = NULL;
+    int r;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    for(;;)
+    {
+        if(0 == ioctl(fd, USBDEVFS_REAPURBNDELAY, &urb))
+        {
+            return (struct read_slot *) urb->usercontext;
+        }
+
+        if(errno != EAGAIN)
+        {
+            return NULL;
+        }
+
+        r = poll(&pfd, 1, timeout);
+        if(r == 0)
+        {
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+
+        if((r < 0) && (errno != EINTR))
+        {
+            return NULL;
+        }
+    }
+}
+
+/* Queue READ_QUEUE_DEPTH reads on endpoint ep.
+ * Returns a negative number if the kernel refuses the URBs, in which case
+ * the caller should carry on with synchronous reads.
+ */
+int usb_read_queue_start(const int fd, const int ep)
+{
+    int i;
+
+    trace(3, fprintf(stderr, "%s\n", __func__));
+
+    if(transport_get(fd) != NULL)
     {
-        fprintf(stderr, "Short read. %d bytes\n", r);
         return -1;
     }
 
-    /* Send SUCCESS as soon as we see a data transfer packet */
-    if(DATA_HDD_FILE_DATA == get_u32_raw(&packet->cmd))
+    if(max_read < (int) sizeof(struct tf_packet))
     {
-        send_success(fd);
+        trace(1, fprintf(stderr, "Read queue needs %d byte URBs, using "
+                         "synchronous reads\n", (int) sizeof(struct tf_packet)));
+        return -1;
     }
 
-    swap_in_packet(packet);
+    read_queue_ep = ep;
+    read_held = NULL;
 
-    len = get_u16(&packet->length);
+    for(i = 0; i < READ_QUEUE_DEPTH; i++)
+    {
+        struct read_slot *slot = &read_queue[i];
+
+        slot->busy = 0;
+        slot->packet = NULL;
+        slot->mapped = 0;
+        slot->urb = malloc(sizeof(struct usbdevfs_urb));
+        read_queue_len = i + 1;
+        if((slot->urb == NULL) || (0 != alloc_read_slot(fd, slot)))
+        {
+            break;
+        }
 
-    if(len < PACKET_HEAD_SIZE)
+        if(0 != submit_read_slot(fd, slot))
+        {
+            trace(1, fprintf(stderr, "Can not queue read URB: %s\n",
+                             strerror(errno)));
+            break;
+        }
+    }
+
+    if(i < READ_QUEUE_DEPTH)
     {
-        fprintf(stderr, "Invalid packet length %04x\n", len);
+        usb_read_queue_stop(fd);
         return -1;
     }
 
-    /* Ignore CRC - support for USB accellerator patch. */
-    if(!ignore_crc)
+    trace(1, fprintf(stderr, "Using %d queued read URBs with %s buffers\n",
+                     read_queue_len,
+                     read_queue[0].mapped ? "usbfs DMA" : "user space"));
+    return 0;
+}
+
+/* Cancel any outstanding reads and release the queue buffers. */
+void usb_read_queue_stop(const int fd)
+{
+    int i;
+
+    trace(3, fprintf(stderr, "%s\n", __func__));
+
+    for(i = 0; i < read_queue_len; i++)
     {
-        __u16 crc;
-        __u16 calc_crc;
-        crc = get_u16(&packet->crc);
-        calc_crc = get_crc(packet);
+        if(read_queue[i].busy)
+        {
+            ioctl(fd, USBDEVFS_DISCARDURB, read_queue[i].urb);
+        }
+    }
 
-        /* Complain about CRC mismatch */
-        if(crc != calc_crc)
+    for(i = 0; i < read_queue_len; i++)
+    {
+        if(read_queue[i].busy)
         {
-            fprintf(stderr, "WARNING: Packet CRC %04x, expected %04x\n", crc,
-                    calc_crc);
+            struct usbdevfs_urb *urb = NULL;
+
+            if(0 == ioctl(fd, USBDEVFS_REAPURB, &urb))
+            {
+                ((struct read_slot *) urb->usercontext)->busy = 0;
+            }
         }
     }
 
-    print_packet(packet, " IN<");
-    return r;
+    for(i = 0; i < read_queue_len; i++)
+    {
+        free_read_slot(&read_queue[i]);
+    }
+
+    read_queue_len = 0;
+    read_held = NULL;
 }
 
-/* Linux usbdevfs has a limit of one page size per read/write.
-   4096 is the most portable maximum we can do for now.
-*/
+/* Receive a Topfield protocol packet from the read queue.
+ * On success *packet points at the received packet, which stays valid until
+ * the next call. When the queue is not running this falls back to a
+ * synchronous read into the fallback buffer.
+ */
+ssize_t get_tf_packet_queued(const int fd, struct tf_packet *fallback,
+                             struct tf_packet **packet)
+{
+    struct read_slot *slot;
+
+    trace(3, fprintf(stderr, "%s\n", __func__));
 
-#define MAX_READ	4096
-#define MAX_WRITE	4096
+    if(read_queue_len == 0)
+    {
+        *packet = fallback;
+        return get_tf_packet(fd, fallback);
+    }
+
+    /* The caller is done with the previous packet - queue its buffer again. */
+    if(read_held != NULL)
+    {
+        slot = read_held;
+        read_held = NULL;
+        if(0 != submit_read_slot(fd, slot))
+        {
+            io_error(-errno, "USB read error: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    slot = reap_read_slot(fd, TF_PROTOCOL_TIMEOUT);
+    if(slot == NULL)
+    {
+        io_error(-errno, "USB read error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    slot->busy = 0;
+    read_held = slot;
+
+    if(slot->urb->status < 0)
+    {
+        io_error(slot->urb->status, "USB read error: %s\n",
+                 strerror(-slot->urb->status));
+        return -1;
+    }
+
+    trace(4, fprintf(stderr, "%s: URB %p, received %d bytes\n", __func__,
+                     (void *) slot->urb, slot->urb->actual_length));
+
+    *packet = slot->packet;
+    return finish_tf_packet(fd, slot->packet, slot->urb->actual_length);
+}
 
 /* This function is adapted from libusb */
-ssize_t usb_bulk_write(const int fd, const int ep, const __u8 * bytes,
-                       const ssize_t length, const int timeout)
+static ssize_t usbfs_bulk_write(const int fd, const int ep,
+                                const __u8 * bytes, const ssize_t length,
+                                const int timeout)
 {
     struct usbdevfs_bulktransfer bulk;
     ssize_t ret;
@@ -428,9 +977,9 @@ ssize_t usb_bulk_write(const int fd, const int ep, const __u8 * bytes,
     {
         bulk.ep = ep;
         bulk.len = length - sent;
-        if(bulk.len > MAX_WRITE)
+        if(bulk.len > (unsigned int) max_write)
         {
-            bulk.len = MAX_WRITE;
+            bulk.len = max_write;
         }
 
         bulk.timeout = timeout;
@@ -447,8 +996,8 @@ ssize_t usb_bulk_write(const int fd, const int ep, const __u8 * bytes,
         ret = ioctl(fd, USBDEVFS_BULK, &bulk);
         if(ret < 0)
         {
-            fprintf(stderr, "error writing to bulk endpoint 0x%x: %s\n",
-                    ep, strerror(errno));
+            io_error(-errno, "error writing to bulk endpoint 0x%x: %s\n",
+                     ep, strerror(errno));
         }
         else
         {
@@ -459,7 +1008,7 @@ ssize_t usb_bulk_write(const int fd, const int ep, const __u8 * bytes,
     }
     while((ret > 0) && (sent < length));
 
-    if((length % 0x200) == 0)
+    if(((length % 0x200) == 0) && (io_settings == NULL))
     {
         fprintf(stderr,
                 "WARNING: USB I/O is modulo 0x200 - this can trigger a bug in Topfield firmware.\n");
@@ -471,8 +1020,9 @@ ssize_t usb_bulk_write(const int fd, const int ep, const __u8 * bytes,
 }
 
 /* This function is adapted from libusb */
-ssize_t usb_bulk_read(const int fd, const int ep, const __u8 * bytes,
-                      const ssize_t size, const int timeout)
+static ssize_t usbfs_bulk_read(const int fd, const int ep,
+                               const __u8 * bytes, const ssize_t size,
+                               const int timeout)
 {
     struct usbdevfs_bulktransfer bulk;
     ssize_t ret;
@@ -487,9 +1037,9 @@ ssize_t usb_bulk_read(const int fd, const int ep, const __u8 * bytes,
     {
         bulk.ep = ep;
         requested = size - retrieved;
-        if(requested > MAX_READ)
+        if(requested > max_read)
         {
-            requested = MAX_READ;
+            requested = max_read;
         }
         bulk.len = requested;
         bulk.timeout = timeout;
@@ -507,8 +1057,8 @@ ssize_t usb_bulk_read(const int fd, const int ep, const __u8 * bytes,
         ret = ioctl(fd, USBDEVFS_BULK, &bulk);
         if(ret < 0)
         {
-            fprintf(stderr, "error %d reading from bulk endpoint 0x%x: %s\n",
-                    errno, ep, strerror(errno));
+            io_error(-errno, "error %d reading from bulk endpoint 0x%x: %s\n",
+                     errno, ep, strerror(errno));
         }
         else
         {
@@ -525,6 +1075,38 @@ ssize_t usb_bulk_read(const int fd, const int ep, const __u8 * bytes,
     return retrieved;
 }
 
+/* Bulk transfers go to usbfs unless fd is bound to another transport */
+ssize_t usb_bulk_write(const int fd, const int ep, const __u8 * bytes,
+                       const ssize_t length, const int timeout)
+{
+    const struct transport *t = transport_get(fd);
+
+    if(t != NULL)
+    {
+        ssize_t r = t->bulk_write(fd, ep, bytes, length, timeout);
+
+        if(r < 0)
+        {
+            io_error(-errno, "error writing to the %s transport: %s\n",
+                     t->name, strerror(errno));
+        }
+        return r;
+    }
+    return usbfs_bulk_write(fd, ep, bytes, length, timeout);
+}
+
+ssize_t usb_bulk_read(const int fd, const int ep, const __u8 * bytes,
+                      const ssize_t size, const int timeout)
+{
+    const struct transport *t = transport_get(fd);
+
+    if(t != NULL)
+    {
+        return t->bulk_read(fd, ep, (__u8 *) bytes, size, timeout);
+    }
+    return usbfs_bulk_read(fd, ep, bytes, size, timeout);
+}
+
 ssize_t read_device_descriptor(const int fd,
                                struct usb_device_descriptor * desc)
 {
@@ -532,7 +1114,7 @@ ssize_t read_device_descriptor(const int fd,
 
     if(r != USB_DT_DEVICE_SIZE)
     {
-        fprintf(stderr, "Can not read device descriptor\n");
+        io_error(-EIO, "Can not read device descriptor\n");
         return -1;
     }
     return r;
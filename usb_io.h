@@ -73,8 +73,28 @@
 /* This is intentionally large enough to allow for a HDD spin up. */
 #define TF_PROTOCOL_TIMEOUT 11000
 
+/* Number of reads kept queued on the bulk IN endpoint during downloads. */
+#define READ_QUEUE_DEPTH 4
 
-#define trace(level, msg) if(verbose >= level) { msg; }
+
+/* Settings for a user of the protocol code that keeps its own, such as a
+ * libpuppy handle. While a thread has settings installed with usb_io_use()
+ * they take the place of ignore_crc and packet_trace, verbose tracing is
+ * off, and errors are recorded in them instead of being printed.
+ */
+struct usb_io_settings
+{
+    int ignoreCrc;
+    int packetTrace;
+    int error;                  /* first error, as a negative errno */
+    char errorText[64];
+};
+
+extern __thread struct usb_io_settings *io_settings;
+
+struct usb_io_settings *usb_io_use(struct usb_io_settings *s);
+
+#define trace(level, msg) if((io_settings == NULL) && (verbose >= level)) { msg; }
 
 extern int verbose;
 
@@ -86,6 +106,11 @@ extern int packet_trace;
 
 extern int ignore_crc;
 
+/* Skip the CRC check on DATA_HDD_FILE_DATA packets because the caller
+   checks them later, off the USB path. Each thread has its own, as it
+   drives its own device. */
+extern __thread int defer_crc;
+
 /* The maximum packet size used by the Toppy.
 */
 #define MAXIMUM_PACKET_SIZE 0xFFFFL
@@ -122,14 +147,29 @@ ssize_t send_cmd_turbo(const int fd, const int turbo_on);
 ssize_t send_cmd_hdd_size(const int fd);
 ssize_t send_cmd_hdd_dir(const int fd, const char *path);
 ssize_t send_cmd_hdd_file_send(const int fd, const __u8 dir, const char *path);
+ssize_t send_cmd_hdd_file_send_with_offset(const int fd, const __u8 dir,
+                                           const char *path,
+                                           const __u64 offset);
 ssize_t send_cmd_hdd_del(const int fd, const char *path);
 ssize_t send_cmd_hdd_rename(const int fd, const char *src, const char *dst);
 ssize_t send_cmd_hdd_create_dir(const int fd, const char *path);
 
+__u16 get_crc(struct tf_packet *packet);
+__u16 swap_in_packet_crc(struct tf_packet *packet);
+void crc_swap_out_packet(struct tf_packet *packet);
+
 void print_packet(const struct tf_packet *packet, const char *prefix);
 
 ssize_t get_tf_packet(const int fd, struct tf_packet *packet);
 ssize_t send_tf_packet(const int fd, struct tf_packet *packet);
+void prepare_tf_packet(struct tf_packet *packet);
+ssize_t send_prepared_tf_packet(const int fd, struct tf_packet *packet);
+
+__u32 usb_probe_capabilities(const int fd);
+int usb_read_queue_start(const int fd, const int ep);
+void usb_read_queue_stop(const int fd);
+ssize_t get_tf_packet_queued(const int fd, struct tf_packet *fallback,
+                             struct tf_packet **packet);
 
 ssize_t usb_bulk_read(const int fd, const int ep, const __u8 * bytes,
                       const ssize_t size, const int timeout);